@@ -0,0 +1,483 @@
+// Stage-level and end-to-end benchmarks. Results go to stdout (or --out) as JSON, one
+// benchmark per line, so that two runs can be diffed or compared with --baseline:
+//
+//     jpeg-bench --out new.json --baseline old.json --threshold 5
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <span>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "bit_reader.h"
+#include "color.h"
+#include "constants.h"
+#include "decoder.h"
+#include "exif.h"
+#include "huffman.h"
+#include "huffman_cache.h"
+#include "huffman_codes.h"
+#include "idct.h"
+#include "transform.h"
+#include "utils.h"
+#ifdef JPEG_DECODER_WITH_FFTW
+#include "fft.h"
+#endif
+
+namespace fs = std::filesystem;
+
+// Keeps the compiler from dropping a computation whose result isn't used.
+template <class T>
+void KeepAlive(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Result {
+    std::string name;
+    size_t iterations;
+    double ns_per_op;
+    double rate;  // millions of items per second
+    std::string unit;
+};
+
+class Runner {
+public:
+    Runner(double min_time, std::string filter) : min_time_(min_time), filter_(std::move(filter)) {
+    }
+
+    // Calls |op| until it took min_time in total, every call handles |items| things
+    // counted by |unit|. The median of a few repetitions is kept.
+    template <class Op>
+    void Run(const std::string& name, double items, const std::string& unit, Op&& op) {
+        if (name.find(filter_) == std::string::npos) {
+            return;
+        }
+        op();
+        double target = min_time_ / kRepetitions;
+        size_t iterations = 1;
+        double seconds = Time(op, iterations);
+        while (seconds < target) {
+            double factor = seconds > 0 ? std::min(target * 1.2 / seconds, 10.0) : 10.0;
+            iterations = std::max(iterations + 1, static_cast<size_t>(iterations * factor));
+            seconds = Time(op, iterations);
+        }
+        std::vector<double> times = {seconds};
+        for (int i = 1; i < kRepetitions; i++) {
+            times.push_back(Time(op, iterations));
+        }
+        std::nth_element(times.begin(), times.begin() + kRepetitions / 2, times.end());
+        double ns_per_op = times[kRepetitions / 2] * 1e9 / iterations;
+        results_.push_back({name, iterations, ns_per_op, items * 1e3 / ns_per_op, unit});
+        std::cerr << name << ": " << ns_per_op << " ns, " << results_.back().rate << " " << unit
+                  << '\n';
+    }
+
+    const std::vector<Result>& Results() const {
+        return results_;
+    }
+
+private:
+    static constexpr int kRepetitions = 5;
+
+    double min_time_;
+    std::string filter_;
+    std::vector<Result> results_;
+
+    template <class Op>
+    static double Time(Op& op, size_t iterations) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            op();
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+void BenchBitReader(Runner& runner) {
+    std::mt19937 random(1);
+    std::vector<Byte> bytes(1 << 16);
+    for (Byte& byte : bytes) {
+        byte = random() % 0xff;  // no markers
+    }
+    size_t total_bits = bytes.size() * 8 - kHuffmanMaxCodeLen;
+    runner.Run("bit_reader/read_bits", bytes.size(), "MB/s", [&] {
+        BitReader reader(bytes);
+        uint32_t sum = 0;
+        for (size_t read = 0, n = 1; read + n <= total_bits; read += n, n = n % 16 + 1) {
+            sum += reader.ReadBits(n);
+        }
+        KeepAlive(sum);
+    });
+
+    // symbols of the luminance AC table as often as their code lengths suggest
+    const HuffmanSpec& spec = kStdHuffman[1];
+    HuffmanCodes codes(spec);
+    std::vector<double> weights;
+    for (uint8_t value : spec.values) {
+        weights.push_back(std::ldexp(1.0, -codes.lengths[value]));
+    }
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    constexpr size_t kSymbols = 1 << 16;
+    std::vector<uint8_t> stream;
+    BitWriter writer(stream);
+    for (size_t i = 0; i < kSymbols; i++) {
+        codes.Write(writer, spec.values[pick(random)]);
+    }
+    writer.Finish();
+    HuffmanTree tree;
+    std::vector<uint8_t> counts(spec.counts.begin(), spec.counts.end());
+    tree.Build(counts, spec.values);
+    runner.Run("bit_reader/decode_huffman", kSymbols, "Msymbols/s", [&] {
+        BitReader reader(stream);
+        reader.SetIsSos(true);
+        int sum = 0;
+        for (size_t i = 0; i < kSymbols; i++) {
+            sum += reader.DecodeHuffman(tree);
+        }
+        KeepAlive(sum);
+    });
+
+    runner.Run("huffman/build", 1, "Mtables/s", [&] {
+        HuffmanTree built;
+        built.Build(counts, spec.values);
+        KeepAlive(&built);
+    });
+    // an example table and one of some other encoder, built on the first call
+    std::vector<uint8_t> other(spec.values.rbegin(), spec.values.rend());
+    runner.Run("huffman/cache_std", 1, "Mtables/s", [&] {
+        KeepAlive(HuffmanCache::Global().Get(counts, spec.values).get());
+    });
+    runner.Run("huffman/cache_other", 1, "Mtables/s", [&] {
+        KeepAlive(HuffmanCache::Global().Get(counts, other).get());
+    });
+}
+
+// Dequantized coefficients that look like the ones of a photo: large DC, a few low
+// frequencies, zeros elsewhere.
+std::vector<int16_t> MakeBlocks(size_t count) {
+    std::mt19937 random(2);
+    std::vector<int16_t> res(count * kFullBlock);
+    for (size_t block = 0; block < count; block++) {
+        int16_t* coefs = res.data() + block * kFullBlock;
+        coefs[0] = static_cast<int>(random() % 2048) - 1024;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3 - i; j++) {
+                coefs[i * kBlockSize + j] += static_cast<int>(random() % 121) - 60;
+            }
+        }
+    }
+    return res;
+}
+
+void BenchIdct(Runner& runner) {
+    constexpr size_t kBlocks = 1024;
+    std::vector<int16_t> coefs = MakeBlocks(kBlocks);
+    std::vector<Byte> out(kBlocks * kFullBlock);
+    auto run_blocks = [&](const std::string& name, auto&& inverse) {
+        runner.Run(name, kBlocks, "Mblocks/s", [&] {
+            for (size_t block = 0; block < kBlocks; block++) {
+                inverse(coefs.data() + block * kFullBlock, out.data() + block * kFullBlock,
+                        kBlockSize);
+            }
+            KeepAlive(out.data());
+        });
+    };
+
+    const std::pair<IdctBackend, const char*> backends[] = {{IdctBackend::kScalar, "scalar"},
+                                                            {IdctBackend::kSse2, "sse2"},
+                                                            {IdctBackend::kAvx2, "avx2"},
+                                                            {IdctBackend::kFftw, "fftw"}};
+    for (auto [backend, name] : backends) {
+        if (!Idct::IsAvailable(backend)) {
+            continue;
+        }
+        Idct idct(backend);
+        run_blocks(std::string("idct/") + name, [&](const int16_t* in, Byte* block, size_t stride) {
+            idct.Inverse(in, block, stride);
+        });
+    }
+    // the blocks of MakeBlocks have only low frequencies
+    const std::tuple<IdctBackend, const char*, void (*)(const int16_t*, Byte*, size_t)> low[] = {
+        {IdctBackend::kScalar, "idct/scalar_low", idct::InverseScalarLow},
+        {IdctBackend::kSse2, "idct/sse2_low", idct::InverseSse2Low},
+        {IdctBackend::kAvx2, "idct/avx2_low", idct::InverseAvx2Low}};
+    for (auto [backend, name, inverse] : low) {
+        if (Idct::IsAvailable(backend)) {
+            run_blocks(name, inverse);
+        }
+    }
+    run_blocks("idct/fill_dc", idct::FillDc);
+    run_blocks("idct/reduced_4x4", idct::InverseScalar4x4);
+    run_blocks("idct/reduced_2x2", idct::InverseScalar2x2);
+    run_blocks("idct/dc", idct::InverseDc);
+
+#ifdef JPEG_DECODER_WITH_FFTW
+    std::vector<double> input(kFullBlock), output(kFullBlock);
+    DctCalculator calculator(kBlockSize, &input, &output);
+    runner.Run("idct/dct_calculator", 1, "Mblocks/s", [&] {
+        calculator.Inverse();
+        KeepAlive(output.data());
+    });
+#endif
+}
+
+void BenchColor(Runner& runner) {
+    constexpr size_t kPixels = 4096;
+    std::mt19937 random(3);
+    std::vector<Byte> y(kPixels), cb(kPixels), cr(kPixels);
+    for (size_t i = 0; i < kPixels; i++) {
+        y[i] = random(), cb[i] = random(), cr[i] = random();
+    }
+    std::vector<Byte> out(kPixels * 4);
+
+    runner.Run("color/ycbcr_to_rgb", kPixels, "MP/s", [&] {
+        int sum = 0;
+        for (size_t i = 0; i < kPixels; i++) {
+            RGB pixel = YCbCr(y[i], cb[i], cr[i]).ToRGB();
+            sum += pixel.r + pixel.g + pixel.b;
+        }
+        KeepAlive(sum);
+    });
+
+    using RowFunction = void (*)(const Byte*, const Byte*, const Byte*, Byte*, size_t,
+                                 PixelFormat);
+    std::vector<std::pair<std::string, RowFunction>> rows = {
+        {"scalar", color::YCbCrToRgbRowScalar}};
+    if (__builtin_cpu_supports("sse2")) {
+        rows.emplace_back("sse2", color::YCbCrToRgbRowSse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        rows.emplace_back("avx2", color::YCbCrToRgbRowAvx2);
+    }
+    for (const auto& [name, row] : rows) {
+        for (PixelFormat format : {PixelFormat::kRGB8, PixelFormat::kRGBA8}) {
+            std::string suffix = format == PixelFormat::kRGB8 ? "_rgb" : "_rgba";
+            runner.Run("color/row_" + name + suffix, kPixels, "MP/s", [&] {
+                row(y.data(), cb.data(), cr.data(), out.data(), kPixels, format);
+                KeepAlive(out.data());
+            });
+        }
+    }
+}
+
+void BenchZigZag(Runner& runner) {
+    std::array<short, kFullBlock> zigzag;
+    std::iota(zigzag.begin(), zigzag.end(), 0);
+    std::array<int16_t, kFullBlock> natural;
+    runner.Run("zigzag/flatten", 1, "Mblocks/s", [&] {
+        utils::Vector2ZigZagFlatten(zigzag.begin(), natural);
+        KeepAlive(natural.data());
+    });
+}
+
+// |jpeg| with what a camera puts before the frame: EXIF (just the orientation) and an APP2 as
+// big as a segment gets, like an ICC profile.
+std::string WithCameraSegments(const std::string& jpeg) {
+    using namespace std::string_literals;
+    auto segment = [](int marker, const std::string& payload) {
+        size_t len = payload.size() + 2;
+        return std::string{'\xff', static_cast<char>(marker), static_cast<char>(len >> 8),
+                           static_cast<char>(len & 0xff)} +
+               payload;
+    };
+    std::string exif =
+        "Exif\0\0MM\0\x2a\0\0\0\x08"                          // TIFF header, IFD0 at 8
+        "\0\x01\x01\x12\0\x03\0\0\0\x01\0\x06\0\0\0\0\0\0"s;  // orientation 6, no IFD1
+    return jpeg.substr(0, 2) + segment(0xe1, exif) + segment(0xe2, std::string(65533, '\0')) +
+           jpeg.substr(2);
+}
+
+void BenchDecode(Runner& runner, const fs::path& corpus) {
+    std::vector<fs::path> files;
+    for (const auto& entry : fs::directory_iterator(corpus)) {
+        if (entry.path().extension() == ".jpg") {
+            files.push_back(entry.path());
+        }
+    }
+    if (files.empty()) {
+        std::cerr << "No *.jpg in " << corpus << ", skipping end-to-end benchmarks\n";
+        return;
+    }
+    std::sort(files.begin(), files.end());
+    for (const fs::path& file : files) {
+        std::ifstream input(file, std::ios::binary);
+        std::string bytes(std::istreambuf_iterator<char>(input), {});
+        std::span<const std::byte> data(reinterpret_cast<const std::byte*>(bytes.data()),
+                                        bytes.size());
+        Image image = Decode(data);
+        runner.Run("decode/" + file.stem().string(),
+                   static_cast<double>(image.Width()) * image.Height(), "MP/s", [&] {
+                       Image res = Decode(data);
+                       KeepAlive(res.Data().data());
+                   });
+        // fed in parts of the size a socket read would give
+        runner.Run("incremental/" + file.stem().string(),
+                   static_cast<double>(image.Width()) * image.Height(), "MP/s", [&] {
+                       constexpr size_t kChunk = 4096;
+                       IncrementalDecoder decoder;
+                       for (size_t pos = 0; pos < data.size(); pos += kChunk) {
+                           auto chunk = data.subspan(pos, std::min(kChunk, data.size() - pos));
+                           if (decoder.Feed(chunk) == FeedStatus::kHeaderReady) {
+                               decoder.Feed({});
+                           }
+                       }
+                       KeepAlive(decoder.GetImage().Data().data());
+                   });
+        runner.Run("coefficients/" + file.stem().string(),
+                   static_cast<double>(image.Width()) * image.Height(), "MP/s", [&] {
+                       CoefficientImage res = DecodeCoefficients(data);
+                       KeepAlive(res.components[0].coefs.data());
+                   });
+        runner.Run("rotate90/" + file.stem().string(),
+                   static_cast<double>(image.Width()) * image.Height(), "MP/s", [&] {
+                       std::vector<uint8_t> res =
+                           Transform(data, {.op = TransformOp::kRotate90});
+                       KeepAlive(res.data());
+                   });
+    }
+
+    std::ifstream input(files.front(), std::ios::binary);
+    std::string photo = WithCameraSegments(std::string(std::istreambuf_iterator<char>(input), {}));
+    std::span<const std::byte> data(reinterpret_cast<const std::byte*>(photo.data()),
+                                    photo.size());
+    runner.Run("exif/read", 1, "Mfiles/s", [&] {
+        std::optional<ExifInfo> info = ReadExif(data);
+        KeepAlive(info->orientation);
+    });
+    // the APP segments of a stream are seeked over
+    Image image = Decode(data);
+    std::istringstream stream(photo);
+    runner.Run("decode_stream/" + files.front().stem().string() + "_app",
+               static_cast<double>(image.Width()) * image.Height(), "MP/s", [&] {
+                   stream.clear();
+                   stream.seekg(0);
+                   Image res = Decode(stream);
+                   KeepAlive(res.Data().data());
+               });
+}
+
+void WriteJson(std::ostream& out, const std::vector<Result>& results) {
+#ifdef __OPTIMIZE__
+    bool optimized = true;
+#else
+    bool optimized = false;
+#endif
+#ifdef JPEG_DECODER_WITH_FFTW
+    bool fftw = true;
+#else
+    bool fftw = false;
+#endif
+    out << "{\n  \"context\": {\"optimized\": " << std::boolalpha << optimized
+        << ", \"fftw\": " << fftw << ", \"avx2\": " << !!__builtin_cpu_supports("avx2")
+        << "},\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        out << "    {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+            << ", \"ns_per_op\": " << result.ns_per_op << ", \"rate\": " << result.rate
+            << ", \"unit\": \"" << result.unit << "\"}" << (i + 1 < results.size() ? "," : "")
+            << '\n';
+    }
+    out << "  ]\n}\n";
+}
+
+// Reads name -> ns_per_op back from a file written by WriteJson.
+std::map<std::string, double> ReadJson(const std::string& path) {
+    std::map<std::string, double> res;
+    std::ifstream input(path);
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t name = line.find("\"name\": \"");
+        size_t ns = line.find("\"ns_per_op\": ");
+        if (name == std::string::npos || ns == std::string::npos) {
+            continue;
+        }
+        name += 9;
+        res[line.substr(name, line.find('"', name) - name)] = std::atof(line.c_str() + ns + 13);
+    }
+    return res;
+}
+
+// Prints the change of every benchmark present in both runs. Returns false if one of them
+// got slower by more than |threshold| percent.
+bool Compare(const std::map<std::string, double>& baseline, const std::vector<Result>& results,
+             double threshold) {
+    bool ok = true;
+    for (const Result& result : results) {
+        auto it = baseline.find(result.name);
+        if (it == baseline.end()) {
+            continue;
+        }
+        double change = (result.ns_per_op / it->second - 1) * 100;
+        bool regression = change > threshold;
+        ok &= !regression;
+        std::cerr << (regression ? "REGRESSION " : "           ") << result.name << ": "
+                  << it->second << " -> " << result.ns_per_op << " ns (" << std::showpos
+                  << change << std::noshowpos << "%)\n";
+    }
+    return ok;
+}
+
+const char* kUsage =
+    "Usage: jpeg-bench [--filter substring] [--min-time seconds] [--corpus dir] [--out file]\n"
+    "                  [--baseline file [--threshold percent]]\n";
+
+int main(int argc, char** argv) {
+    std::string filter, out_path, baseline_path;
+    fs::path corpus = JPEG_BENCH_CORPUS;
+    double min_time = 0.5, threshold = 10;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) {
+            std::cerr << kUsage;
+            return 2;
+        }
+        std::string value = argv[i + 1];
+        if (!strcmp(argv[i], "--filter")) {
+            filter = value;
+        } else if (!strcmp(argv[i], "--min-time")) {
+            min_time = std::atof(value.c_str());
+        } else if (!strcmp(argv[i], "--corpus")) {
+            corpus = value;
+        } else if (!strcmp(argv[i], "--out")) {
+            out_path = value;
+        } else if (!strcmp(argv[i], "--baseline")) {
+            baseline_path = value;
+        } else if (!strcmp(argv[i], "--threshold")) {
+            threshold = std::atof(value.c_str());
+        } else {
+            std::cerr << kUsage;
+            return 2;
+        }
+        i++;
+    }
+#ifndef __OPTIMIZE__
+    std::cerr << "Warning: built without optimizations, use -DCMAKE_BUILD_TYPE=Release\n";
+#endif
+
+    Runner runner(min_time, filter);
+    BenchBitReader(runner);
+    BenchIdct(runner);
+    BenchColor(runner);
+    BenchZigZag(runner);
+    BenchDecode(runner, corpus);
+
+    if (out_path.empty()) {
+        WriteJson(std::cout, runner.Results());
+    } else {
+        std::ofstream out(out_path);
+        WriteJson(out, runner.Results());
+    }
+    if (!baseline_path.empty() && !Compare(ReadJson(baseline_path), runner.Results(), threshold)) {
+        return 1;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "bit_writer.h"
+#include "constants.h"
+
+// Encoding side of the example Huffman tables, shared by the corpus generator and the
+// Huffman benchmarks.
+
+struct HuffmanSpec {
+    std::array<uint8_t, 16> counts;
+    std::vector<uint8_t> values;
+};
+
+// Example tables from K.3 of T.81: luminance DC, luminance AC, chrominance DC and AC.
+inline const HuffmanSpec kStdHuffman[4] = {
+    {std::to_array(kStdLuminanceDcCounts),
+     {std::begin(kStdLuminanceDcValues), std::end(kStdLuminanceDcValues)}},
+    {std::to_array(kStdLuminanceAcCounts),
+     {std::begin(kStdLuminanceAcValues), std::end(kStdLuminanceAcValues)}},
+    {std::to_array(kStdChrominanceDcCounts),
+     {std::begin(kStdChrominanceDcValues), std::end(kStdChrominanceDcValues)}},
+    {std::to_array(kStdChrominanceAcCounts),
+     {std::begin(kStdChrominanceAcValues), std::end(kStdChrominanceAcValues)}},
+};
+
+struct HuffmanCodes {
+    std::array<uint16_t, 256> codes{};
+    std::array<uint8_t, 256> lengths{};
+
+    explicit HuffmanCodes(const HuffmanSpec& spec) {
+        uint16_t code = 0;
+        size_t ind = 0;
+        for (int len = 1; len <= 16; len++) {
+            for (int i = 0; i < spec.counts[len - 1]; i++, code++, ind++) {
+                codes[spec.values[ind]] = code;
+                lengths[spec.values[ind]] = len;
+            }
+            code <<= 1;
+        }
+    }
+
+    void Write(BitWriter& writer, int symbol) const {
+        writer.Write(codes[symbol], lengths[symbol]);
+    }
+};
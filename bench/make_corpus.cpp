@@ -0,0 +1,302 @@
+// Generates the end-to-end benchmark corpus: synthetic images of a few sizes encoded as
+// baseline JPEG with every chroma subsampling and a few qualities. The files are checked
+// in, so this is run only to change the corpus:
+//
+//     jpeg-corpus bench/corpus
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "huffman_codes.h"
+
+// Planes of Y, Cb and Cr samples.
+struct Planes {
+    size_t width, height;
+    std::vector<float> y, cb, cr;
+};
+
+// Smooth gradients, a few sharp edges, fine texture and some noise, so that the quality
+// setting matters about as much as for a photo.
+Planes Synthesize(size_t width, size_t height) {
+    Planes res{width, height, {}, {}, {}};
+    uint32_t state = 2463534242u;
+    auto noise = [&state] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return static_cast<float>(state % 1024) / 1024 - 0.5f;
+    };
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            float u = static_cast<float>(x) / width, v = static_cast<float>(y) / height;
+            float r = 200 * (1 - v) + 40 * std::sin(9 * u);
+            float g = 120 + 80 * std::cos(5 * u + 3 * v);
+            float b = 90 + 120 * v;
+            float dx = u - 0.6f, dy = v - 0.45f;
+            float ring = std::sin(140 * std::sqrt(dx * dx + dy * dy));
+            if (dx * dx + dy * dy < 0.06f) {
+                r += 30 * ring, g += 30 * ring, b += 30 * ring;
+            }
+            if ((x / 64 + y / 48) % 5 == 0) {
+                r = 255 - r, b = 255 - b;
+            }
+            float n = 24 * noise();
+            r = std::clamp(r + n, 0.f, 255.f);
+            g = std::clamp(g + n, 0.f, 255.f);
+            b = std::clamp(b + n, 0.f, 255.f);
+            res.y.push_back(0.299f * r + 0.587f * g + 0.114f * b);
+            res.cb.push_back(128 - 0.168736f * r - 0.331264f * g + 0.5f * b);
+            res.cr.push_back(128 + 0.5f * r - 0.418688f * g - 0.081312f * b);
+        }
+    }
+    return res;
+}
+
+// Size category and the bits of |value| as in F.1.2.1 of T.81.
+void WriteValue(BitWriter& writer, const HuffmanCodes& codes, int run, int value) {
+    int magnitude = std::abs(value);
+    int size = 0;
+    while (magnitude >> size) {
+        size++;
+    }
+    codes.Write(writer, run << 4 | size);
+    writer.Write(value < 0 ? value + (1 << size) - 1 : value, size);
+}
+
+struct Component {
+    const std::vector<float>* plane;
+    int horizontal, vertical;  // sampling factors
+    int table;                 // 0 for luminance, 1 for chrominance
+};
+
+class Encoder {
+public:
+    explicit Encoder(int quality) {
+        int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+        for (int i = 0; i < kFullBlock; i++) {
+            quant_[0][i] = std::clamp((kStdLuminanceQuant[i] * scale + 50) / 100, 1, 255);
+            quant_[1][i] = std::clamp((kStdChrominanceQuant[i] * scale + 50) / 100, 1, 255);
+        }
+        for (int i = 0; i < kBlockSize; i++) {
+            for (int j = 0; j < kBlockSize; j++) {
+                zigzag_[kZigZagIndexesMatching[i][j]] = i * kBlockSize + j;
+            }
+        }
+        for (int k = 0; k < kBlockSize; k++) {
+            for (int x = 0; x < kBlockSize; x++) {
+                float c = k == 0 ? std::sqrt(0.5f) : 1;
+                cos_[k][x] = c / 2 * std::cos((2 * x + 1) * k * M_PI / 16);
+            }
+        }
+    }
+
+    // Horizontal and vertical sampling factors of luminance, chroma has 1x1. No chroma at
+    // all if |gray|.
+    std::vector<uint8_t> Encode(const Planes& planes, int hor, int ver, bool gray) {
+        std::vector<Component> components = {{&planes.y, gray ? 1 : hor, gray ? 1 : ver, 0}};
+        if (!gray) {
+            chroma_[0] = Subsample(planes.cb, planes, hor, ver);
+            chroma_[1] = Subsample(planes.cr, planes, hor, ver);
+            components.push_back({&chroma_[0], 1, 1, 1});
+            components.push_back({&chroma_[1], 1, 1, 1});
+        }
+        width_ = planes.width, height_ = planes.height;
+        hor_ = components[0].horizontal, ver_ = components[0].vertical;
+
+        std::vector<uint8_t> out = {0xff, 0xd8};
+        WriteTables(out, components.size());
+        WriteFrame(out, components);
+        BitWriter writer(out);
+        std::vector<int> prev_dc(components.size());
+        size_t mcus_x = (width_ + 8 * hor_ - 1) / (8 * hor_);
+        size_t mcus_y = (height_ + 8 * ver_ - 1) / (8 * ver_);
+        for (size_t mcu_y = 0; mcu_y < mcus_y; mcu_y++) {
+            for (size_t mcu_x = 0; mcu_x < mcus_x; mcu_x++) {
+                for (size_t c = 0; c < components.size(); c++) {
+                    const Component& component = components[c];
+                    for (int v = 0; v < component.vertical; v++) {
+                        for (int h = 0; h < component.horizontal; h++) {
+                            size_t x = (mcu_x * component.horizontal + h) * kBlockSize;
+                            size_t y = (mcu_y * component.vertical + v) * kBlockSize;
+                            WriteBlock(writer, component, x, y, prev_dc[c]);
+                        }
+                    }
+                }
+            }
+        }
+        writer.Finish();
+        out.insert(out.end(), {0xff, 0xd9});
+        return out;
+    }
+
+private:
+    int quant_[2][kFullBlock];
+    int zigzag_[kFullBlock];  // natural index of every zigzag position
+    float cos_[kBlockSize][kBlockSize];
+    std::vector<float> chroma_[2];
+    size_t width_ = 0, height_ = 0;
+    int hor_ = 1, ver_ = 1;
+
+    // Averages hor x ver boxes, the plane keeps width and height of the image rounded up.
+    std::vector<float> Subsample(const std::vector<float>& plane, const Planes& planes, int hor,
+                                 int ver) {
+        size_t width = (planes.width + hor - 1) / hor, height = (planes.height + ver - 1) / ver;
+        std::vector<float> res(width * height);
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                float sum = 0;
+                for (int v = 0; v < ver; v++) {
+                    for (int h = 0; h < hor; h++) {
+                        size_t src_x = std::min(x * hor + h, planes.width - 1);
+                        size_t src_y = std::min(y * ver + v, planes.height - 1);
+                        sum += plane[src_y * planes.width + src_x];
+                    }
+                }
+                res[y * width + x] = sum / (hor * ver);
+            }
+        }
+        return res;
+    }
+
+    void WriteBlock(BitWriter& writer, const Component& component, size_t x0, size_t y0,
+                    int& prev_dc) {
+        // edges are repeated past the end of the plane
+        size_t width = (width_ * component.horizontal + hor_ - 1) / hor_;
+        size_t height = (height_ * component.vertical + ver_ - 1) / ver_;
+        float samples[kBlockSize][kBlockSize];
+        for (int y = 0; y < kBlockSize; y++) {
+            for (int x = 0; x < kBlockSize; x++) {
+                size_t src_x = std::min(x0 + x, width - 1), src_y = std::min(y0 + y, height - 1);
+                samples[y][x] = (*component.plane)[src_y * width + src_x] - 128;
+            }
+        }
+        float rows[kBlockSize][kBlockSize];
+        for (int y = 0; y < kBlockSize; y++) {
+            for (int k = 0; k < kBlockSize; k++) {
+                rows[y][k] = 0;
+                for (int x = 0; x < kBlockSize; x++) {
+                    rows[y][k] += cos_[k][x] * samples[y][x];
+                }
+            }
+        }
+        int coefs[kFullBlock];
+        for (int k = 0; k < kBlockSize; k++) {
+            for (int l = 0; l < kBlockSize; l++) {
+                float sum = 0;
+                for (int y = 0; y < kBlockSize; y++) {
+                    sum += cos_[l][y] * rows[y][k];
+                }
+                int natural = l * kBlockSize + k;
+                coefs[natural] = std::lround(sum / quant_[component.table][natural]);
+            }
+        }
+
+        const HuffmanCodes& dc = codes_[component.table * 2];
+        const HuffmanCodes& ac = codes_[component.table * 2 + 1];
+        WriteValue(writer, dc, 0, coefs[0] - prev_dc);
+        prev_dc = coefs[0];
+        int run = 0;
+        for (int i = 1; i < kFullBlock; i++) {
+            int value = coefs[zigzag_[i]];
+            if (value == 0) {
+                run++;
+                continue;
+            }
+            for (; run > 15; run -= 16) {
+                ac.Write(writer, 0xf0);
+            }
+            WriteValue(writer, ac, run, value);
+            run = 0;
+        }
+        if (run > 0) {
+            ac.Write(writer, 0x00);
+        }
+    }
+
+    void WriteTables(std::vector<uint8_t>& out, size_t components) {
+        size_t tables = components == 1 ? 1 : 2;
+        out.insert(out.end(), {0xff, 0xdb, 0, static_cast<uint8_t>(2 + 65 * tables)});
+        for (size_t t = 0; t < tables; t++) {
+            out.push_back(t);
+            for (int i = 0; i < kFullBlock; i++) {
+                out.push_back(quant_[t][zigzag_[i]]);
+            }
+        }
+        for (size_t t = 0; t < tables * 2; t++) {
+            const HuffmanSpec& spec = kStdHuffman[t];
+            size_t len = 2 + 1 + 16 + spec.values.size();
+            out.insert(out.end(), {0xff, 0xc4, static_cast<uint8_t>(len >> 8),
+                                   static_cast<uint8_t>(len)});
+            out.push_back((t % 2) << 4 | t / 2);
+            out.insert(out.end(), spec.counts.begin(), spec.counts.end());
+            out.insert(out.end(), spec.values.begin(), spec.values.end());
+        }
+    }
+
+    void WriteFrame(std::vector<uint8_t>& out, const std::vector<Component>& components) {
+        uint8_t count = components.size();
+        out.insert(out.end(), {0xff, 0xc0, 0, static_cast<uint8_t>(8 + 3 * count), 8,
+                               static_cast<uint8_t>(height_ >> 8), static_cast<uint8_t>(height_),
+                               static_cast<uint8_t>(width_ >> 8), static_cast<uint8_t>(width_),
+                               count});
+        for (uint8_t i = 0; i < count; i++) {
+            out.push_back(i + 1);
+            out.push_back(components[i].horizontal << 4 | components[i].vertical);
+            out.push_back(components[i].table);
+        }
+        out.insert(out.end(), {0xff, 0xda, 0, static_cast<uint8_t>(6 + 2 * count), count});
+        for (uint8_t i = 0; i < count; i++) {
+            out.push_back(i + 1);
+            out.push_back(components[i].table << 4 | components[i].table);
+        }
+        out.insert(out.end(), {0, 63, 0});
+    }
+
+    const HuffmanCodes codes_[4] = {HuffmanCodes(kStdHuffman[0]), HuffmanCodes(kStdHuffman[1]),
+                                    HuffmanCodes(kStdHuffman[2]), HuffmanCodes(kStdHuffman[3])};
+};
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: jpeg-corpus <output directory>\n";
+        return 2;
+    }
+    std::filesystem::path dir = argv[1];
+    std::filesystem::create_directories(dir);
+
+    struct Sampling {
+        const char* name;
+        int hor, ver;
+        bool gray;
+    };
+    const Sampling samplings[] = {
+        {"444", 1, 1, false}, {"422", 2, 1, false}, {"420", 2, 2, false}, {"gray", 1, 1, true}};
+    struct Size {
+        size_t width, height;
+        std::vector<int> qualities;
+    };
+    // every quality of the big size would make the corpus several times larger
+    const Size sizes[] = {{64, 64, {50, 75, 95}}, {640, 480, {50, 75, 95}}, {1920, 1080, {75}}};
+
+    for (const auto& [width, height, qualities] : sizes) {
+        Planes planes = Synthesize(width, height);
+        for (const Sampling& sampling : samplings) {
+            for (int quality : qualities) {
+                std::string name = std::to_string(width) + "x" + std::to_string(height) + "_" +
+                                   sampling.name + "_q" + std::to_string(quality) + ".jpg";
+                std::vector<uint8_t> data =
+                    Encoder(quality).Encode(planes, sampling.hor, sampling.ver, sampling.gray);
+                std::ofstream(dir / name, std::ios::binary)
+                    .write(reinterpret_cast<const char*>(data.data()), data.size());
+                std::cout << name << ": " << data.size() << " bytes\n";
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <span>
+#include <vector>
+#include "decoder.h"
+
+// IncrementalDecoder for coroutines. Whoever receives the bytes (a socket callback, an
+// event loop) pushes them, and a coroutine awaits what the decoder makes of them:
+//
+//     FeedStatus status;
+//     while ((status = co_await decoder.Next()) != FeedStatus::kDone) {
+//         Show(decoder.GetImage(), decoder.RowsReady());
+//     }
+//
+// The coroutine is resumed from Push or Close, on the thread that calls them. Nothing is
+// locked, so Push, Close and the coroutine must not run at once.
+class AsyncDecoder {
+public:
+    class Awaiter {
+    public:
+        bool await_ready();
+
+        void await_suspend(std::coroutine_handle<> handle);
+
+        // Throws what the decoder did, e.g. on broken input.
+        FeedStatus await_resume();
+
+    private:
+        friend class AsyncDecoder;
+
+        explicit Awaiter(AsyncDecoder& owner) : owner_(owner) {
+        }
+
+        AsyncDecoder& owner_;
+    };
+
+    explicit AsyncDecoder(const DecodeOptions& options = {});
+
+    AsyncDecoder(const AsyncDecoder&) = delete;
+    AsyncDecoder& operator=(const AsyncDecoder&) = delete;
+
+    // Waits for the next status other than kNeedMoreData. Once the image is done every
+    // call gives kDone right away.
+    Awaiter Next();
+
+    // Hands the bytes to the decoder. If a coroutine waits and they are enough for something
+    // new, it is resumed before Push returns, if no one waits they are kept for Next.
+    void Push(std::span<const std::byte> data);
+
+    // There is no more input: the waiting coroutine gets kDone, or an error if the image is
+    // cut short.
+    void Close();
+
+    const Image& GetImage() const {
+        return decoder_.GetImage();
+    }
+
+    size_t RowsReady() const {
+        return decoder_.RowsReady();
+    }
+
+private:
+    IncrementalDecoder decoder_;
+    std::vector<std::byte> pending_;  // pushed while no one waited
+    bool closed_ = false;
+    std::coroutine_handle<> waiting_;
+    FeedStatus status_ = FeedStatus::kNeedMoreData;
+    std::exception_ptr error_;
+
+    // Feeds |data| and returns true if there is something to resume the coroutine with.
+    bool Advance(std::span<const std::byte> data);
+};
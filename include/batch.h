@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+#include "decoder.h"
+#include "image.h"
+
+// Image for DecodeBatch, either in memory or in a file.
+struct BatchInput {
+    std::string path;  // read only if |data| is empty
+    std::span<const std::byte> data;
+};
+
+struct BatchResult {
+    Image image;
+    std::exception_ptr error;  // set if the image can't be decoded, |image| is empty then
+    double seconds = 0;        // time spent on this image alone
+};
+
+// Gets the result of inputs[index] as soon as it is decoded. It is called from the
+// decoding threads, possibly for several images at once.
+using BatchSink = std::function<void(size_t index, BatchResult& result)>;
+
+// Decodes all of |inputs| with options.threads threads in total. An image bigger than its
+// share of the batch is decoded by all of them together, one image at a time, the others
+// are grouped into runs of about the same size that the threads take one by one. A failed
+// image doesn't stop the others, an exception thrown by |sink| does.
+void DecodeBatch(std::span<const BatchInput> inputs, const BatchSink& sink,
+                 const DecodeOptions& options = {});
+
+// Same, but keeps all the results, in the order of |inputs|.
+std::vector<BatchResult> DecodeBatch(std::span<const BatchInput> inputs,
+                                     const DecodeOptions& options = {});
@@ -1,14 +1,68 @@
 #pragma once
 
 #include <istream>
+#include <span>
+#include <stdexcept>
+#include <vector>
 #include "types.h"
 #include "constants.h"
 #include "huffman.h"
 
+// Reads JPEG segments and entropy-coded data. Bytes are pulled from the input in
+// big chunks into an internal buffer, bits are handed out from a 64-bit accumulator.
+// In SOS mode 0xFF00 pairs are unstuffed while refilling, and the accumulator is
+// padded with zeros once a marker (or the end of the input) is reached.
 class BitReader {
 public:
+    // Thrown by a reader of appended input when it needs bytes that have not arrived yet.
+    struct OutOfData : std::runtime_error {
+        OutOfData() : std::runtime_error("the input ended too early") {
+        }
+    };
+
+    // Where the reader is, enough to come back to it with Restore.
+    struct State {
+        size_t position;  // of the next byte in the input
+        uint64_t acc;
+        int bits;
+        bool is_sos, hit_marker;
+    };
+
+    BitReader() = default;
+
     explicit BitReader(std::istream& input);
 
+    // Reads from memory, |data| must outlive the reader.
+    explicit BitReader(std::span<const Byte> data);
+
+    // Start reading another input, the buffers are kept.
+    void Reset(std::istream& input);
+
+    void Reset(std::span<const Byte> data);
+
+    // Starts reading input that is given by Append as it arrives. Until Close, running out
+    // of it throws OutOfData, the reader can then be brought back to a saved state and
+    // continued once there is more. Bytes before the position are dropped on Append.
+    void ResetAppendable();
+
+    void Append(std::span<const Byte> data);
+
+    // No more bytes will be appended, the rest of the input is read as if it was in memory.
+    void Close();
+
+    State Save() const {
+        return {discarded_ + buffer_pos_, acc_, bits_, is_sos_, hit_marker_};
+    }
+
+    // Goes back to |state|, which must not be before the position of the last Append.
+    void Restore(const State& state) {
+        buffer_pos_ = state.position - discarded_;
+        acc_ = state.acc;
+        bits_ = state.bits;
+        is_sos_ = state.is_sos;
+        hit_marker_ = state.hit_marker;
+    }
+
     bool ReadBit();
 
     DByte ReadDByte();
@@ -23,6 +77,11 @@ public:
 
     std::vector<Byte> ReadNBytes(size_t n);
 
+    void ReadNBytes(std::span<Byte> out);
+
+    // Drops |n| bytes, a stream is seeked over them if it can be.
+    void Skip(size_t n);
+
     uint8_t ReadRawDataLen(HuffmanTree& tree);
 
     int ReadRawDataItem(uint8_t len);
@@ -31,11 +90,90 @@ public:
 
     void SetIsSos(bool is_sos);
 
+    // Reads entropy-coded data up to the next marker other than RSTn, which is left
+    // unread. Bytes are returned as they are, with stuffing and RST markers. For input in
+    // memory the result points into it, otherwise it is valid until the next call.
+    std::span<const Byte> ReadScanData();
+
+    // Returns the next |n| bits (1 <= n <= 32) without consuming them.
+    uint32_t Peek(int n) {
+        if (bits_ < n) {
+            Refill(n);
+        }
+        return static_cast<uint32_t>(acc_ >> (64 - n));
+    }
+
+    // Drops |n| bits, which must have been made available by Peek.
+    void Consume(int n) {
+        acc_ <<= n;
+        bits_ -= n;
+    }
+
+    uint32_t ReadBits(int n) {
+        uint32_t res = Peek(n);
+        Consume(n);
+        return res;
+    }
+
+    // Reads |len| bits and sign-extends them as described in F.2.2.1 of T.81.
+    int ReceiveExtend(int len) {
+        if (len == 0) {
+            return 0;
+        }
+        int res = ReadBits(len);
+        if (res < (1 << (len - 1))) {
+            res -= (1 << len) - 1;
+        }
+        return res;
+    }
+
+    // Decodes the next Huffman-coded symbol.
+    int DecodeHuffman(const HuffmanTree& tree) {
+        uint16_t entry = tree.Lookup(Peek(kHuffmanLookupBits));
+        if (entry == 0) {
+            return DecodeHuffmanLong(tree);
+        }
+        Consume(entry >> 8);
+        return entry & 0xff;
+    }
+
+    // Offset of the next unread byte from the beginning of the input. Inside of the
+    // entropy-coded data it is only approximate: the accumulator reads ahead.
+    size_t Position() const {
+        return discarded_ + buffer_pos_ - bits_ / 8;
+    }
+
+    // True if the entropy-coded data ran into a marker and the rest is zero padding.
+    bool HitMarker() const {
+        return hit_marker_;
+    }
+
 private:
-    std::istream* input_;
-    Byte last_ = 0xff;
-    char pos_ = -1;
+    static constexpr size_t kBufferSize = 1 << 16;
+
+    std::istream* input_ = nullptr;
+    std::vector<Byte> storage_;
+    const Byte* buffer_ = nullptr;  // storage_ or the memory given to the constructor
+    std::vector<Byte> scan_data_;
+    size_t buffer_pos_ = 0, buffer_end_ = 0;
+    size_t discarded_ = 0;  // bytes of the input dropped from the front of storage_
+
+    uint64_t acc_ = 0;  // valid bits are the highest |bits_| ones
+    int bits_ = 0;
     bool is_sos_ = false;
+    bool hit_marker_ = false;
+    bool appending_ = false;  // more input may be appended
+
+    void Refill(int n);
+
+    int DecodeHuffmanLong(const HuffmanTree& tree);
+
+    void RefillEntropy();
+
+    bool FillBuffer(size_t need);
+
+    // FillBuffer for bytes that are needed right away rather than read ahead.
+    bool Require(size_t need);
 
-    void RefreshState();
-};
\ No newline at end of file
+    Byte NextByte();
+};
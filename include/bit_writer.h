@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "types.h"
+
+// Writes entropy-coded data. Bits are collected in a 64-bit accumulator and go out a byte
+// at a time, every 0xFF byte is followed by a stuffed zero.
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<Byte>& out) : out_(out) {
+    }
+
+    // Appends the low |count| bits of |bits|, 0 <= count <= 32.
+    void Write(uint32_t bits, int count) {
+        acc_ = acc_ << count | (bits & ((uint64_t{1} << count) - 1));
+        size_ += count;
+        if (size_ >= 32) {
+            Flush();
+        }
+    }
+
+    // Pads the last byte with ones and writes out everything.
+    void Finish();
+
+private:
+    // Writes the whole bytes of the accumulator.
+    void Flush();
+
+    std::vector<Byte>& out_;
+    uint64_t acc_ = 0;
+    int size_ = 0;
+};
@@ -3,6 +3,267 @@
 #pragma once
 
 #include <image.h>
+#include <idct.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <istream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
 
-Image Decode(std::istream& input);
+#ifdef JPEG_DECODER_WITH_STATS
+inline constexpr bool kDecodeStatsEnabled = true;
+#else
+inline constexpr bool kDecodeStatsEnabled = false;
+#endif
+
+// What a decode read and where its time went. Filled only if the library is built with
+// JPEG_DECODER_STATS, otherwise it stays empty. Stages run by several threads at once
+// count the time of every thread, so their sum may exceed the wall time.
+struct DecodeStats {
+    // bytes of the segments by marker name ("DQT", "SOS", ...), the marker included
+    std::map<std::string, size_t> segment_bytes;
+    size_t entropy_coded_bytes = 0;
+    size_t huffman_symbols = 0;
+    size_t mcus = 0;
+    size_t blocks = 0;
+    size_t dc_only_blocks = 0;  // blocks whose AC coefficients are all zero
+    // nanoseconds spent reading the segments, in the Huffman decoding, in dequantization
+    // and the IDCT, in upsampling and colour conversion, and handing the pixels out
+    // (allocating the image, calling the sinks). Baseline images are dequantized right
+    // in the Huffman decoding loop, that time is in entropy_ns.
+    uint64_t parse_ns = 0, entropy_ns = 0, idct_ns = 0, color_ns = 0, output_ns = 0;
+
+    DecodeStats& operator+=(const DecodeStats& other);
+};
+
+struct DecodeOptions {
+    PixelFormat format = PixelFormat::kRGB8;
+    IdctBackend idct = IdctBackend::kAuto;
+    // 1, 2, 4 or 8: the image is decoded that many times smaller (rounding up) with
+    // reduced transforms, at 8 every block is just its DC
+    size_t scale = 1;
+    // decode only this rectangle (in pixels of the scaled output, clipped to it), the
+    // image gets its size
+    std::optional<Rect> roi;
+    // blocks transformed with one FFTW plan, 0 means a whole MCU row
+    size_t idct_batch = 0;
+    // threads decoding restart intervals in parallel, 0 means one per core
+    size_t threads = 1;
+    // without restart markers: one thread reads the entropy-coded data, the others run
+    // the IDCT and colour conversion, used only if threads != 1
+    bool pipelined = false;
+    // decoded MCU rows buffered between the stages of the pipeline
+    size_t pipeline_depth = 4;
+    // progressive images: called after every scan but the last one with the image made
+    // from the coefficients read so far, blurry at first and sharper with every scan
+    std::function<void(const Image&)> on_scan;
+    // the decode adds its counters to it, decodes running at once may share one
+    DecodeStats* stats = nullptr;
+};
+
+Image Decode(std::istream& input, const DecodeOptions& options = {});
+
+// Decodes only |roi|, same as options.roi = roi. Blocks outside of it are read to keep
+// the DC prediction, but not transformed, and the scan is left as soon as it passes
+// the last row of the rectangle.
+Image Decode(std::istream& input, const Rect& roi, DecodeOptions options = {});
+
+// Decodes straight from memory without copying the input.
+Image Decode(std::span<const std::byte> data, const DecodeOptions& options = {});
+
+// Maps the file into memory and decodes it from there.
+Image DecodeFile(const std::string& path, const DecodeOptions& options = {});
+
+// Decoded rows handed to the sink of DecodeRows.
+struct ImageBand {
+    size_t width, height;    // of the whole image
+    size_t first_row, rows;  // the band holds rows [first_row, first_row + rows)
+    PixelFormat format;
+    size_t stride;
+    const uint8_t* data;
+
+    // |y| counts from the top of the band.
+    std::span<const uint8_t> Row(size_t y) const {
+        return {data + y * stride, width * BytesPerPixel(format)};
+    }
+};
+
+using BandSink = std::function<void(const ImageBand&)>;
+
+// Decodes the image one MCU row (8 to 32 pixel rows before scaling) at a time and passes
+// the bands to |sink| top to bottom, a band is valid only during the call. Only the
+// buffers of one band are kept, so memory doesn't grow with the height and no threads
+// are used. Progressive images still need the coefficients of the whole image, the
+// bands are produced after the last scan.
+void DecodeRows(std::istream& input, const BandSink& sink, const DecodeOptions& options = {});
+
+void DecodeRows(std::span<const std::byte> data, const BandSink& sink,
+                const DecodeOptions& options = {});
+
+struct DecodeScratch;
+
+// Decodes one image after another and keeps all of the memory it needs between them: the
+// tables, the buffers of an MCU row, the IDCT with its FFTW plans and the output image.
+// With threads == 1 and no on_scan, an image that is no bigger than one decoded before
+// (with the same options) is decoded without a single heap allocation. A decoder must not
+// be used by several threads at once, a worker needs one of its own.
+class Decoder {
+public:
+    explicit Decoder(const DecodeOptions& options = {});
+
+    Decoder(Decoder&&) noexcept;
+    Decoder& operator=(Decoder&&) noexcept;
+
+    ~Decoder();
+
+    // Used by the next decodes, can be changed between them.
+    DecodeOptions& Options() {
+        return options_;
+    }
+
+    // The image belongs to the decoder and is overwritten by the next call.
+    const Image& Decode(std::istream& input);
+
+    const Image& Decode(std::span<const std::byte> data);
+
+    const Image& DecodeFile(const std::string& path);
+
+    void DecodeRows(std::istream& input, const BandSink& sink);
+
+    void DecodeRows(std::span<const std::byte> data, const BandSink& sink);
+
+    // Moves the last image out, the next decode has to allocate a new one.
+    Image TakeImage();
+
+private:
+    DecodeOptions options_;
+    std::unique_ptr<DecodeScratch> scratch_;
+};
+
+// What IncrementalDecoder::Feed got to.
+enum class FeedStatus {
+    kNeedMoreData,  // everything fed so far is used
+    kHeaderReady,   // the size is known, the image has it
+    kRowsReady,     // more rows of the image are decoded
+    kDone,          // the whole image is decoded
+};
+
+// Decodes an image that arrives in parts, e.g. from the network: bytes are fed as they
+// come and decoded as far as they go. Where it stopped is kept between the calls, be it
+// in the middle of a segment or of the entropy-coded data. Baseline images are decoded
+// MCU by MCU and come out an MCU row at a time. A scan of a progressive image is decoded
+// once all of it has arrived, the rows are made after the last one. No threads are used,
+// so threads and pipelined of the options are ignored.
+class IncrementalDecoder {
+public:
+    explicit IncrementalDecoder(const DecodeOptions& options = {});
+
+    IncrementalDecoder(IncrementalDecoder&&) noexcept;
+    IncrementalDecoder& operator=(IncrementalDecoder&&) noexcept;
+
+    ~IncrementalDecoder();
+
+    // Takes a copy of |data| and decodes as much as it can. Stops once the header is read,
+    // the next call goes on, |data| may be empty then.
+    FeedStatus Feed(std::span<const std::byte> data);
+
+    // No more bytes will come, the rest is decoded the way Decode does it: returns kDone
+    // or throws if the image is cut short.
+    FeedStatus Close();
+
+    // Starts another image, the memory is kept.
+    void Reset();
+
+    // Has the size of the output once the header is ready, rows [0, RowsReady()) of it
+    // are decoded.
+    const Image& GetImage() const;
+
+    size_t RowsReady() const;
+
+    Image TakeImage();
+
+private:
+    class Impl;
+
+    std::unique_ptr<Impl> impl_;
+};
+
+struct ComponentInfo {
+    int id;
+    int horizontal, vertical;  // sampling factors
+    int quantization_table;
+};
+
+struct ProbeInfo {
+    size_t width = 0, height = 0;
+    std::vector<ComponentInfo> components;
+    std::string comment;
+    // ids of the tables defined before the scan
+    std::vector<int> quantization_tables;
+    std::vector<int> dc_tables, ac_tables;
+    size_t restart_interval = 0;
+    bool progressive = false;
+    // libjpeg quality (1..100) the quantization tables correspond to, 0 if there are none
+    int quality = 0;
+};
+
+// Reads only the segments before the first scan, the entropy-coded data is not touched.
+ProbeInfo Probe(std::istream& input);
+
+ProbeInfo Probe(std::span<const std::byte> data);
+
+// Quantized DCT coefficients of one component.
+struct CoefficientPlane {
+    int id;
+    int horizontal, vertical;  // sampling factors
+    int quantization_table;    // id of the table the coefficients are quantized with
+    int dc_table, ac_table;    // ids of the Huffman tables of its last scan
+    // blocks cover whole MCUs, so on the right and at the bottom there may be more of them
+    // than the image needs
+    size_t blocks_x = 0, blocks_y = 0;
+    // blocks row by row, 64 coefficients of a block in natural order
+    std::vector<int16_t> coefs;
+
+    std::span<const int16_t, 64> Block(size_t x, size_t y) const {
+        return std::span<const int16_t, 64>(coefs.data() + (y * blocks_x + x) * 64, 64);
+    }
+
+    std::span<int16_t, 64> Block(size_t x, size_t y) {
+        return std::span<int16_t, 64>(coefs.data() + (y * blocks_x + x) * 64, 64);
+    }
+};
+
+struct QuantizationTableValues {
+    int id;
+    std::array<uint16_t, 64> values;  // in natural order
+};
+
+struct HuffmanTableValues {
+    int table_class;  // 0 for DC, 1 for AC
+    int id;
+    std::array<uint8_t, 16> counts;  // codes of every length from 1 to 16 bits
+    std::vector<uint8_t> values;
+};
+
+struct CoefficientImage {
+    size_t width = 0, height = 0;
+    bool progressive = false;
+    std::vector<CoefficientPlane> components;
+    std::vector<QuantizationTableValues> quantization_tables;
+    // the tables as they are at the end of the image
+    std::vector<HuffmanTableValues> huffman_tables;
+    std::string comment;
+};
+
+// Reads the quantized coefficients of every block: only the entropy decoding and the DC
+// prediction are done, no dequantization, IDCT or colour conversion. All scans of
+// progressive images are read and merged.
+CoefficientImage DecodeCoefficients(std::istream& input);
+
+CoefficientImage DecodeCoefficients(std::span<const std::byte> data);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <decoder.h>
+#include <cstdint>
+#include <vector>
+
+enum class HuffmanTables {
+    // the tables of the image, if they have codes for every symbol, optimized otherwise
+    kSource,
+    // built from the symbols of the image as in K.2 of T.81: one DC and one AC table for
+    // the first component and one pair shared by the others
+    kOptimized,
+};
+
+// Writes the coefficients as a baseline JFIF with a single interleaved scan (a gray image
+// gets a non-interleaved one). The blocks are entropy-coded as they are, no DCT is done,
+// so decoding the result gives back exactly the same coefficients. The quantization
+// tables are written as they are, ones that need 16 bits make it an SOF1 image.
+std::vector<uint8_t> EncodeCoefficients(const CoefficientImage& image,
+                                        HuffmanTables tables = HuffmanTables::kSource);
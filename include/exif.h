@@ -0,0 +1,32 @@
+#pragma once
+
+#include <transform.h>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string>
+
+// What a gallery needs of the EXIF of a photo.
+struct ExifInfo {
+    // 1..8 as in the TIFF Orientation tag, 1 means the pixels are stored upright
+    int orientation = 1;
+    // PixelXDimension and PixelYDimension, 0 if there are none
+    size_t width = 0, height = 0;
+    // DateTimeOriginal ("YYYY:MM:DD HH:MM:SS"), or DateTime if it is missing
+    std::string capture_time;
+    // the JPEG thumbnail of IFD1, points into the data the EXIF was read from, empty if there
+    // is none
+    std::span<const std::byte> thumbnail;
+};
+
+// Finds the EXIF APP1 segment among the segments of |jpeg| before the first scan, which
+// are skipped by their lengths, the entropy-coded data is not touched. Returns nullopt if
+// there is no EXIF or its TIFF header is broken. Entries that point outside of the
+// segment are ignored.
+std::optional<ExifInfo> ReadExif(std::span<const std::byte> jpeg);
+
+// Same for the payload of an APP1 segment, starting with "Exif\0\0".
+std::optional<ExifInfo> ParseExif(std::span<const std::byte> app1);
+
+// The transform that puts an image with |orientation| upright, kNone if it is not 2..8.
+TransformOp UprightTransform(int orientation);
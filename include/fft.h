@@ -3,6 +3,7 @@
 #pragma once
 
 #include <cstddef>
+#include <string>
 #include <vector>
 #include <memory>
 
@@ -20,3 +21,31 @@ private:
     class Impl;
     std::unique_ptr<Impl> impl_;
 };
+
+// Same transform as DctCalculator for up to |batch| consecutive width by width blocks
+// at once. Plans are created with FFTW_MEASURE and shared by the whole process, one
+// per (width, number of blocks).
+class BatchDctCalculator {
+public:
+    BatchDctCalculator(size_t width, size_t batch);
+
+    double *Input(size_t block);
+
+    const double *Output(size_t block) const;
+
+    // Transforms the first |count| <= batch blocks.
+    void Inverse(size_t count);
+
+    size_t Batch() const;
+
+    ~BatchDctCalculator();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// FFTW wisdom lets a process skip the FFTW_MEASURE planning done before.
+bool LoadFftwWisdom(const std::string &path);
+
+bool SaveFftwWisdom(const std::string &path);
@@ -2,36 +2,132 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <span>
+#include <stdexcept>
 #include <vector>
 #include <cstddef>
 #include <cstdint>
-#include <memory>
+
+// Number of bits resolved by a single probe of the lookup tables.
+constexpr int kHuffmanLookupBits = 9;
+constexpr int kHuffmanMaxCodeLen = 16;
 
 // HuffmanTree decoder for DHT section.
 class HuffmanTree {
 public:
-    HuffmanTree();
+    constexpr HuffmanTree() {
+        maxcode_.fill(-1);
+    }
 
     HuffmanTree(const HuffmanTree&) = delete;
     HuffmanTree& operator=(const HuffmanTree&) = delete;
 
-    HuffmanTree(HuffmanTree&&);
-    HuffmanTree& operator=(HuffmanTree&&);
+    constexpr HuffmanTree(HuffmanTree&&) = default;
+    constexpr HuffmanTree& operator=(HuffmanTree&&) = default;
 
     // code_lengths is the array of size no more than 16 with number of
     // terminated nodes in the Huffman tree.
     // values are the values of the terminated nodes in the consecutive
     // level order.
-    void Build(const std::vector<uint8_t>& code_lengths, const std::vector<uint8_t>& values);
+    // constexpr, so that the tables known in advance are built at compile time.
+    constexpr void Build(std::span<const uint8_t> code_lengths, std::span<const uint8_t> values);
 
     // Moves the state of the huffman tree by |bit|. If the node is terminated,
     // returns true and overwrites |value|. If it is intermediate, returns false
     // and value is unmodified.
     bool Move(bool bit, int& value);
 
-    ~HuffmanTree();
+    // |bits| are the next kHuffmanLookupBits bits of the stream. Returns
+    // (code length << 8) | symbol, or 0 if the code is longer than kHuffmanLookupBits.
+    uint16_t Lookup(uint32_t bits) const {
+        return lookup_[bits];
+    }
+
+    // Same as Lookup, but for AC tables also resolves the coefficient following the
+    // run/size symbol: (value << 8) | (run << 4) | (code length + size). Returns 0 if
+    // the code and its extra bits don't fit in kHuffmanLookupBits bits, or if the
+    // value doesn't fit in a signed byte.
+    int16_t LookupAc(uint32_t bits) const {
+        return ac_lookup_[bits];
+    }
+
+    // Decodes a code longer than kHuffmanLookupBits. |bits| are the next 16 bits of the
+    // stream. Returns false if they don't start with a valid code.
+    bool DecodeLong(uint32_t bits, int& len, int& value) const;
 
 private:
-    class Impl;
-    std::unique_ptr<Impl> impl_;
+    std::array<uint16_t, 1 << kHuffmanLookupBits> lookup_{};
+    std::array<int16_t, 1 << kHuffmanLookupBits> ac_lookup_{};
+    // maxcode_[l] is the largest code of length l (-1 if there are none),
+    // values_[valoffset_[l] + code] is the symbol of the code of length l.
+    std::array<int32_t, kHuffmanMaxCodeLen + 1> maxcode_{};
+    std::array<int32_t, kHuffmanMaxCodeLen + 1> valoffset_{};
+    std::array<uint8_t, 256> values_{};
+
+    // state of Move
+    int32_t code_ = 0;
+    int code_len_ = 0;
 };
+
+constexpr void HuffmanTree::Build(std::span<const uint8_t> code_lengths,
+                                  std::span<const uint8_t> values) {
+    if (std::accumulate(code_lengths.begin(), code_lengths.end(), static_cast<size_t>(0)) !=
+        values.size()) {
+        throw std::invalid_argument("sum(code_lengths) != values.size()");
+    }
+    if (code_lengths.size() > kHuffmanMaxCodeLen) {
+        throw std::invalid_argument("too big array in build");
+    }
+    if (values.size() > values_.size()) {
+        throw std::invalid_argument("too many values in build");
+    }
+
+    lookup_.fill(0);
+    ac_lookup_.fill(0);
+    maxcode_.fill(-1);
+    valoffset_.fill(0);
+    std::copy(values.begin(), values.end(), values_.begin());
+    code_ = 0;
+    code_len_ = 0;
+
+    // canonical codes: consecutive numbers within a length, shifted left between lengths
+    int32_t code = 0;
+    int32_t ind = 0;
+    for (int len = 1; len <= static_cast<int>(code_lengths.size()); len++) {
+        valoffset_[len] = ind - code;
+        if (code + code_lengths[len - 1] > (1 << len)) {
+            throw std::invalid_argument("can't add one more code to huffman");
+        }
+        for (int i = 0; i < code_lengths[len - 1]; i++, code++, ind++) {
+            if (len > kHuffmanLookupBits) {
+                continue;
+            }
+            int shift = kHuffmanLookupBits - len;
+            std::fill_n(lookup_.begin() + (code << shift), 1 << shift, (len << 8) | values[ind]);
+        }
+        if (code_lengths[len - 1] > 0) {
+            maxcode_[len] = code - 1;
+        }
+        code <<= 1;
+    }
+
+    for (uint32_t bits = 0; bits < lookup_.size(); bits++) {
+        int len = lookup_[bits] >> 8;
+        int run = lookup_[bits] >> 4 & 0xf;
+        int size = lookup_[bits] & 0xf;
+        if (len == 0 || size == 0 || len + size > kHuffmanLookupBits) {
+            continue;
+        }
+        int value = (bits >> (kHuffmanLookupBits - len - size)) & ((1 << size) - 1);
+        if (value < (1 << (size - 1))) {
+            value -= (1 << size) - 1;
+        }
+        if (value < -128 || value > 127) {
+            continue;
+        }
+        ac_lookup_[bits] = value * 256 + run * 16 + len + size;
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "huffman.h"
+
+// Built Huffman decoders keyed by the contents of their DHT tables. Most images use the
+// example tables of Annex K or one of a few sets of some encoder, so there is no need to
+// build a decoder for every DHT segment. Thread-safe.
+class HuffmanCache {
+public:
+    static constexpr size_t kDefaultCapacity = 64;
+
+    // |capacity| is the number of tables besides the example ones of Annex K.
+    explicit HuffmanCache(size_t capacity = kDefaultCapacity);
+
+    HuffmanCache(const HuffmanCache&) = delete;
+    HuffmanCache& operator=(const HuffmanCache&) = delete;
+
+    // The decoder of the table, arguments are the ones of HuffmanTree::Build. The example
+    // tables are built at compile time, others on the first use; when there are too many,
+    // the least recently used one is forgotten, the decoders handed out stay valid.
+    std::shared_ptr<const HuffmanTree> Get(std::span<const uint8_t> code_lengths,
+                                           std::span<const uint8_t> values);
+
+    size_t Size() const;
+
+    // the one used by the decoder
+    static HuffmanCache& Global();
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::vector<uint8_t> code_lengths, values;
+        std::shared_ptr<const HuffmanTree> tree;
+    };
+
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    std::list<Entry> entries_;  // the most recently used first
+    std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index_;
+
+    // with |mutex_| locked, moves the entry found to the front
+    std::shared_ptr<const HuffmanTree> Find(uint64_t hash, std::span<const uint8_t> code_lengths,
+                                            std::span<const uint8_t> values);
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "types.h"
+
+enum class IdctBackend {
+    kAuto,    // the fastest native backend supported by the CPU
+    kFftw,    // floating point reference, only if built with FFTW
+    kScalar,  // fixed point LLM (islow) transform
+    kSse2,
+    kAvx2,
+};
+
+// The coefficients with zigzag indices below kLowCoefs all lie in the top-left
+// kLowBlockSize x kLowBlockSize corner of a block.
+constexpr int kLowBlockSize = 4;
+constexpr int kLowCoefs = 10;
+
+namespace idct {
+// All native backends take dequantized coefficients of one 8x8 block in natural
+// (row-major) order and write level-shifted samples clamped to [0, 255], rows of
+// |out| are |stride| bytes apart. They share one fixed-point algorithm and give
+// bit-identical results.
+void InverseScalar(const int16_t* coefs, Byte* out, size_t stride);
+
+void InverseSse2(const int16_t* coefs, Byte* out, size_t stride);
+
+void InverseAvx2(const int16_t* coefs, Byte* out, size_t stride);
+
+// The same transforms for blocks with non-zero coefficients only in the top-left
+// kLowBlockSize x kLowBlockSize corner, the products with the others are skipped.
+void InverseScalarLow(const int16_t* coefs, Byte* out, size_t stride);
+
+void InverseSse2Low(const int16_t* coefs, Byte* out, size_t stride);
+
+void InverseAvx2Low(const int16_t* coefs, Byte* out, size_t stride);
+
+// The same pixels for a block with only the DC: all of them are equal.
+void FillDc(const int16_t* coefs, Byte* out, size_t stride);
+
+// Reduced transforms for scaled decoding: the same input gives a 4x4, 2x2 or 1x1 block
+// made from the low frequencies only (as libjpeg's jidctred.c).
+void InverseScalar4x4(const int16_t* coefs, Byte* out, size_t stride);
+
+void InverseScalar2x2(const int16_t* coefs, Byte* out, size_t stride);
+
+void InverseDc(const int16_t* coefs, Byte* out, size_t stride);
+}  // namespace idct
+
+class Idct {
+public:
+    // |batch| is the number of blocks the FFTW backend transforms with one plan.
+    explicit Idct(IdctBackend backend = IdctBackend::kAuto, size_t batch = 1);
+
+    Idct(Idct&&);
+    Idct& operator=(Idct&&);
+
+    void Inverse(const int16_t* coefs, Byte* out, size_t stride);
+
+    // Transforms |count| consecutive blocks of |coefs|, the i-th one is written to outs[i].
+    void InverseMany(const int16_t* coefs, size_t count, Byte* const* outs, size_t stride);
+
+    // Same, |last| has the zigzag index of the last non-zero coefficient of every block (a
+    // larger one will do). Blocks with only the DC or only low frequencies take shortcuts
+    // giving the same pixels, FFTW transforms all of them.
+    void InverseMany(const int16_t* coefs, const Byte* last, size_t count, Byte* const* outs,
+                     size_t stride);
+
+    // Never kAuto: the backend that was actually selected.
+    IdctBackend Backend() const {
+        return backend_;
+    }
+
+    static bool IsAvailable(IdctBackend backend);
+
+    // Wisdom of the FFTW backend, both return false if it is not built in.
+    static bool LoadFftwWisdom(const std::string& path);
+
+    static bool SaveFftwWisdom(const std::string& path);
+
+    ~Idct();
+
+private:
+    class FftwImpl;
+
+    IdctBackend backend_;
+    void (*inverse_)(const int16_t*, Byte*, size_t) = nullptr;
+    void (*inverse_low_)(const int16_t*, Byte*, size_t) = nullptr;
+    std::unique_ptr<FftwImpl> fftw_;
+};
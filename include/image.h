@@ -1,46 +1,115 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <string>
+#include <utility>
 
 struct RGB {
     int r, g, b;
 };
 
+struct Rect {
+    size_t x, y, width, height;
+};
+
+enum class PixelFormat { kRGB8, kRGBA8, kBGR8, kGray8 };
+
+constexpr size_t BytesPerPixel(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::kRGBA8:
+            return 4;
+        case PixelFormat::kGray8:
+            return 1;
+        default:
+            return 3;
+    }
+}
+
+// Image with 8-bit channels in one contiguous buffer, rows are Stride() bytes apart.
 class Image {
 public:
     Image() {
     }
-    Image(size_t width, size_t height) {
-        SetSize(width, height);
+    Image(size_t width, size_t height, PixelFormat format = PixelFormat::kRGB8) {
+        SetSize(width, height, format);
     }
 
-    void SetSize(size_t width, size_t height) {
-        data_.assign(height, std::vector<RGB>(width));
+    // Pixels are left uninitialized. |stride| is rounded up to a whole row.
+    void SetSize(size_t width, size_t height, PixelFormat format = PixelFormat::kRGB8,
+                 size_t stride = 0) {
+        width_ = width;
+        height_ = height;
+        format_ = format;
+        stride_ = std::max(stride, width * BytesPerPixel(format));
+        data_.resize(stride_ * height_);
     }
 
     size_t Width() const {
-        if (data_.empty()) {
-            return 0;
-        }
-        return data_[0].size();
+        return width_;
     }
 
     size_t Height() const {
-        return data_.size();
+        return height_;
     }
 
-    void SetPixel(int y, int x, const RGB& pixel) {
-        data_[y][x] = pixel;
+    PixelFormat Format() const {
+        return format_;
     }
 
-    RGB GetPixel(int y, int x) const {
-        return data_[y][x];
+    size_t Stride() const {
+        return stride_;
+    }
+
+    std::span<uint8_t> Row(size_t y) {
+        return {data_.data() + y * stride_, width_ * BytesPerPixel(format_)};
+    }
+
+    std::span<const uint8_t> Row(size_t y) const {
+        return {data_.data() + y * stride_, width_ * BytesPerPixel(format_)};
+    }
+
+    // The whole buffer, Height() rows of Stride() bytes.
+    std::span<uint8_t> Data() {
+        return data_;
     }
 
-    RGB& GetPixel(int y, int x) {
-        return data_[y][x];
+    std::span<const uint8_t> Data() const {
+        return data_;
+    }
+
+    void SetPixel(int y, int x, const RGB& pixel) {
+        uint8_t* p = data_.data() + y * stride_ + x * BytesPerPixel(format_);
+        switch (format_) {
+            case PixelFormat::kRGBA8:
+                p[3] = 255;
+                [[fallthrough]];
+            case PixelFormat::kRGB8:
+                p[0] = pixel.r, p[1] = pixel.g, p[2] = pixel.b;
+                break;
+            case PixelFormat::kBGR8:
+                p[0] = pixel.b, p[1] = pixel.g, p[2] = pixel.r;
+                break;
+            case PixelFormat::kGray8:
+                p[0] = (299 * pixel.r + 587 * pixel.g + 114 * pixel.b + 500) / 1000;
+                break;
+        }
+    }
+
+    RGB GetPixel(int y, int x) const {
+        const uint8_t* p = data_.data() + y * stride_ + x * BytesPerPixel(format_);
+        switch (format_) {
+            case PixelFormat::kBGR8:
+                return {p[2], p[1], p[0]};
+            case PixelFormat::kGray8:
+                return {p[0], p[0], p[0]};
+            default:
+                return {p[0], p[1], p[2]};
+        }
     }
 
     void SetComment(const std::string& comment) {
@@ -52,6 +121,27 @@ public:
     }
 
 private:
-    std::vector<std::vector<RGB>> data_;
+    // vector that doesn't zero-initialise on resize
+    template <class T>
+    struct DefaultInitAllocator : std::allocator<T> {
+        template <class U>
+        struct rebind {
+            using other = DefaultInitAllocator<U>;
+        };
+
+        template <class U>
+        void construct(U* p) {
+            ::new (static_cast<void*>(p)) U;
+        }
+
+        template <class U, class... Args>
+        void construct(U* p, Args&&... args) {
+            ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+        }
+    };
+
+    std::vector<uint8_t, DefaultInitAllocator<uint8_t>> data_;
+    size_t width_ = 0, height_ = 0, stride_ = 0;
+    PixelFormat format_ = PixelFormat::kRGB8;
     std::string comment_;
 };
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. It is memory-mapped where the platform allows it and
+// read into a buffer otherwise.
+class MappedFile {
+public:
+    // Throws std::system_error if the file can't be opened or mapped.
+    explicit MappedFile(const std::string& path);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile();
+
+    std::span<const std::byte> Data() const {
+        return {data_, size_};
+    }
+
+private:
+    const std::byte* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<std::byte> fallback_;
+};
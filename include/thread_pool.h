@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running parallel loops. The thread calling ParallelFor
+// takes part in the loop too, so a pool of size 1 has no workers at all.
+class ThreadPool {
+public:
+    // |threads| counts the calling thread, 0 means one per hardware thread.
+    explicit ThreadPool(size_t threads = 0);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool();
+
+    size_t Size() const {
+        return workers_.size() + 1;
+    }
+
+    // Calls task(i) for every i in [0, count) and waits for all of them. The first
+    // exception thrown by a task is rethrown here, the tasks not started yet are skipped.
+    // Only one ParallelFor may run at a time.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t count_ = 0;
+    std::atomic<size_t> next_ = 0;
+    size_t running_ = 0;
+    size_t generation_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+
+    void WorkerLoop();
+
+    void RunTasks();
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <decoder.h>
+#include <encoder.h>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+enum class TransformOp {
+    kNone,
+    kFlipHorizontal,
+    kFlipVertical,
+    kTranspose,   // across the main diagonal
+    kTransverse,  // across the other diagonal
+    kRotate90,    // clockwise
+    kRotate180,
+    kRotate270,
+};
+
+struct TransformOptions {
+    TransformOp op = TransformOp::kNone;
+    // applied after |op|, in its pixels: x and y are moved left and up to the nearest
+    // MCU boundary, the rest is clipped to the image
+    std::optional<Rect> crop;
+    HuffmanTables tables = HuffmanTables::kSource;
+};
+
+// Moves, flips and transposes the quantized blocks, so the image is not decoded and
+// nothing is lost. A partial MCU at the right or bottom edge can't be moved to the other
+// side, so the dimensions a flip would move it along are trimmed to whole MCUs, as
+// jpegtran -trim does. Throws std::invalid_argument if nothing is left.
+CoefficientImage Transform(const CoefficientImage& image, TransformOp op,
+                           const std::optional<Rect>& crop = std::nullopt);
+
+// DecodeCoefficients, Transform and EncodeCoefficients in one go.
+std::vector<uint8_t> Transform(std::span<const std::byte> jpeg, const TransformOptions& options);
@@ -6,7 +6,7 @@
 using DByte = uint16_t;
 using Byte = uint8_t;
 
-enum Marker { SOI, EOI, COM, APPn, DQT, SOF0, DHT, SOS };
+enum Marker { SOI, EOI, COM, APPn, DQT, SOF0, SOF2, DHT, SOS, DRI, RSTn };
 
 template <class T, const int SIZE>
 using ImageBlock = std::array<std::array<T, SIZE>, SIZE>;
\ No newline at end of file
@@ -1,13 +1,15 @@
 #pragma once
 
+#include <stdexcept>
+#include <vector>
 #include "types.h"
 #include "constants.h"
 
 namespace utils {
 const char* ToString(Marker v);
 
-template <class BidirectionalIterator, class T>
-void Vector2ZigZagFlatten(BidirectionalIterator data, std::vector<T>& out) {
+template <class BidirectionalIterator, class Container>
+void Vector2ZigZagFlatten(BidirectionalIterator data, Container& out) {
     if (out.size() != kFullBlock) {
         throw std::runtime_error("out.size() for zigzag must be equal to kFullBlock");
     }
@@ -1,16 +1,169 @@
+#include "include/batch.h"
 #include "include/decoder.h"
 #include "include/image.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
 
-int main() {
-    std::ifstream fin("bad_quality.jpg");
-    if (!fin.is_open()) {
-        std::cerr << "Can't find bad_quality.jpg\n";
-        return 1;
+namespace fs = std::filesystem;
+
+const char* kUsage =
+    "Usage: jpeg-decoder [-t threads] [-s scale] [-o dir [-f ppm|raw]] [-v]\n"
+    "                    <file or directory>...\n"
+    "Decodes the files (directories are searched for *.jpg and *.jpeg) and prints the\n"
+    "throughput. The images are written to |dir| if it is given and discarded otherwise.\n"
+    "-v also prints what was read and the time of every stage, summed over the images.\n";
+
+bool IsJpeg(const fs::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return extension == ".jpg" || extension == ".jpeg";
+}
+
+void WriteImage(const Image& image, const fs::path& path, bool raw) {
+    std::ofstream out(path, std::ios::binary);
+    if (!raw) {
+        out << "P6\n" << image.Width() << " " << image.Height() << "\n255\n";
+    }
+    for (size_t y = 0; y < image.Height(); y++) {
+        auto row = image.Row(y);
+        out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    if (!out) {
+        throw std::runtime_error("can't write " + path.string());
+    }
+}
+
+void PrintStats(const DecodeStats& stats) {
+    if (!kDecodeStatsEnabled) {
+        std::cout << "Built without JPEG_DECODER_STATS, no stats\n";
+        return;
+    }
+    std::cout << "Bytes:";
+    for (const auto& [name, bytes] : stats.segment_bytes) {
+        std::cout << " " << name << " " << bytes << ",";
+    }
+    std::cout << " entropy-coded " << stats.entropy_coded_bytes << "\n";
+    std::cout << stats.huffman_symbols << " Huffman symbols, " << stats.mcus << " MCUs, "
+              << stats.blocks << " blocks, " << stats.dc_only_blocks << " of them only DC\n";
+    std::cout << "Time, ms: parse " << stats.parse_ns / 1e6 << ", entropy "
+              << stats.entropy_ns / 1e6 << ", IDCT " << stats.idct_ns / 1e6 << ", colour "
+              << stats.color_ns / 1e6 << ", output " << stats.output_ns / 1e6 << "\n";
+}
+
+double Percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t i = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+int main(int argc, char** argv) {
+    DecodeOptions options;
+    options.threads = 0;
+    std::vector<std::string> paths;
+    std::string output_dir;
+    bool raw = false;
+    DecodeStats stats;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "-t") && has_value) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && has_value) {
+            options.scale = std::atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && has_value) {
+            output_dir = argv[++i];
+        } else if (!strcmp(argv[i], "-f") && has_value) {
+            raw = !strcmp(argv[++i], "raw");
+        } else if (!strcmp(argv[i], "-v")) {
+            options.stats = &stats;
+        } else if (argv[i][0] == '-') {
+            std::cerr << kUsage;
+            return 2;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty()) {
+        std::cerr << kUsage;
+        return 2;
+    }
+
+    std::vector<BatchInput> inputs;
+    for (const std::string& path : paths) {
+        std::error_code error;
+        if (!fs::is_directory(path, error)) {
+            inputs.push_back({path, {}});
+            continue;
+        }
+        std::vector<std::string> found;
+        for (const auto& entry : fs::recursive_directory_iterator(path, error)) {
+            if (entry.is_regular_file() && IsJpeg(entry.path())) {
+                found.push_back(entry.path().string());
+            }
+        }
+        std::sort(found.begin(), found.end());
+        for (std::string& file : found) {
+            inputs.push_back({std::move(file), {}});
+        }
+    }
+
+    if (!output_dir.empty()) {
+        fs::create_directories(output_dir);
+    }
+
+    std::vector<double> latencies(inputs.size());
+    std::vector<size_t> pixels(inputs.size());
+    size_t failed = 0;
+    std::mutex mutex;
+    auto start = std::chrono::steady_clock::now();
+    DecodeBatch(
+        inputs,
+        [&](size_t index, BatchResult& result) {
+            latencies[index] = result.seconds;
+            pixels[index] = result.image.Width() * result.image.Height();
+            try {
+                if (result.error) {
+                    std::rethrow_exception(result.error);
+                }
+                if (!output_dir.empty()) {
+                    fs::path name = fs::path(inputs[index].path).stem();
+                    name += raw ? ".raw" : ".ppm";
+                    WriteImage(result.image, output_dir / name, raw);
+                }
+            } catch (const std::exception& e) {
+                std::lock_guard lock(mutex);
+                std::cerr << inputs[index].path << ": " << e.what() << '\n';
+                failed++;
+            }
+        },
+        options);
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t total_pixels = 0;
+    for (size_t count : pixels) {
+        total_pixels += count;
+    }
+    std::cout << "Decoded " << inputs.size() - failed << " of " << inputs.size() << " images in "
+              << seconds << " s\n";
+    std::cout << inputs.size() / seconds << " images/s, " << total_pixels / seconds / 1e6
+              << " MP/s\n";
+    std::cout << "Latency p50 " << Percentile(latencies, 0.5) * 1e3 << " ms, p99 "
+              << Percentile(latencies, 0.99) * 1e3 << " ms\n";
+    if (options.stats) {
+        PrintStats(stats);
     }
-    Image res = Decode(fin);
-    fin.close();
-    std::cout << "Image size " << res.Width() << "x" << res.Height() << " px\n";
-    std::cout << "Comment: " << res.GetComment() << '\n';
+    return failed == 0 ? 0 : 1;
 }
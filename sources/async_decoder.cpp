@@ -0,0 +1,61 @@
+#include <stdexcept>
+#include <utility>
+
+#include "async_decoder.h"
+
+bool AsyncDecoder::Awaiter::await_ready() {
+    bool ready = owner_.Advance(owner_.pending_);
+    owner_.pending_.clear();
+    return ready;
+}
+
+void AsyncDecoder::Awaiter::await_suspend(std::coroutine_handle<> handle) {
+    owner_.waiting_ = handle;
+}
+
+FeedStatus AsyncDecoder::Awaiter::await_resume() {
+    if (owner_.error_) {
+        std::rethrow_exception(std::exchange(owner_.error_, nullptr));
+    }
+    return owner_.status_;
+}
+
+AsyncDecoder::AsyncDecoder(const DecodeOptions& options) : decoder_(options) {
+}
+
+AsyncDecoder::Awaiter AsyncDecoder::Next() {
+    return Awaiter(*this);
+}
+
+void AsyncDecoder::Push(std::span<const std::byte> data) {
+    if (closed_) {
+        throw std::logic_error("pushing to a closed decoder");
+    }
+    if (!waiting_) {
+        pending_.insert(pending_.end(), data.begin(), data.end());
+        return;
+    }
+    if (Advance(data)) {
+        std::exchange(waiting_, nullptr).resume();
+    }
+}
+
+void AsyncDecoder::Close() {
+    closed_ = true;
+    if (waiting_ && Advance({})) {
+        std::exchange(waiting_, nullptr).resume();
+    }
+}
+
+bool AsyncDecoder::Advance(std::span<const std::byte> data) {
+    try {
+        status_ = decoder_.Feed(data);
+        if (status_ == FeedStatus::kNeedMoreData && closed_) {
+            status_ = decoder_.Close();
+        }
+    } catch (...) {
+        error_ = std::current_exception();
+        return true;
+    }
+    return status_ != FeedStatus::kNeedMoreData;
+}
@@ -0,0 +1,100 @@
+#include <batch.h>
+
+#include <chrono>
+#include <filesystem>
+#include <numeric>
+#include <utility>
+
+#include "thread_pool.h"
+
+// Images smaller than this are never split between threads.
+constexpr size_t kMinSplitSize = 256 << 10;
+// Runs of small images per thread, so that a slow run doesn't hold up the rest.
+constexpr size_t kRunsPerThread = 4;
+
+size_t InputSize(const BatchInput& input) {
+    if (!input.data.empty()) {
+        return input.data.size();
+    }
+    std::error_code error;
+    size_t size = std::filesystem::file_size(input.path, error);
+    return error ? 0 : size;
+}
+
+void DecodeBatch(std::span<const BatchInput> inputs, const BatchSink& sink,
+                 const DecodeOptions& options) {
+    ThreadPool pool(options.threads);
+    size_t threads = pool.Size();
+
+    // the images go to the sink, only the rest of the decoder's memory is reused
+    auto decode = [&](size_t index, Decoder& decoder) {
+        const BatchInput& input = inputs[index];
+        BatchResult result;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            if (input.data.empty()) {
+                decoder.DecodeFile(input.path);
+            } else {
+                decoder.Decode(input.data);
+            }
+            result.image = decoder.TakeImage();
+        } catch (...) {
+            result.error = std::current_exception();
+        }
+        result.seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        sink(index, result);
+    };
+
+    // sizes of the encoded data tell how much work an image is well enough
+    std::vector<size_t> sizes;
+    for (const BatchInput& input : inputs) {
+        sizes.push_back(InputSize(input));
+    }
+    size_t total = std::accumulate(sizes.begin(), sizes.end(), size_t{0});
+    std::vector<size_t> small;
+    Decoder split_decoder(options);
+    split_decoder.Options().threads = threads;
+    split_decoder.Options().pipelined = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (threads > 1 && sizes[i] >= kMinSplitSize && sizes[i] * threads > total) {
+            decode(i, split_decoder);
+        } else {
+            small.push_back(i);
+        }
+    }
+
+    // consecutive small images are grouped into runs of about the same size
+    size_t small_total = 0;
+    for (size_t i : small) {
+        small_total += sizes[i];
+    }
+    size_t run_size = small_total / (threads * kRunsPerThread) + 1;
+    std::vector<size_t> run_starts;
+    size_t current = run_size;
+    for (size_t j = 0; j < small.size(); j++) {
+        if (current >= run_size) {
+            run_starts.push_back(j);
+            current = 0;
+        }
+        current += sizes[small[j]];
+    }
+    run_starts.push_back(small.size());
+
+    pool.ParallelFor(run_starts.size() - 1, [&](size_t run) {
+        Decoder decoder(options);
+        decoder.Options().threads = 1;
+        for (size_t j = run_starts[run]; j < run_starts[run + 1]; j++) {
+            decode(small[j], decoder);
+        }
+    });
+}
+
+std::vector<BatchResult> DecodeBatch(std::span<const BatchInput> inputs,
+                                     const DecodeOptions& options) {
+    std::vector<BatchResult> res(inputs.size());
+    DecodeBatch(
+        inputs, [&](size_t index, BatchResult& result) { res[index] = std::move(result); },
+        options);
+    return res;
+}
@@ -1,20 +1,80 @@
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
 #include "types.h"
 #include "constants.h"
 #include "bit_reader.h"
 
-BitReader::BitReader(std::istream& input) : input_(&input) {
+namespace {
+uint64_t LoadBigEndian64(const Byte* data) {
+    uint64_t res;
+    std::memcpy(&res, data, sizeof(res));
+    if constexpr (std::endian::native == std::endian::little) {
+        res = __builtin_bswap64(res);
+    }
+    return res;
 }
 
-bool BitReader::ReadBit() {
-    if (pos_ < 0) {
-        RefreshState();
-    }
-    bool res = (last_ >> pos_) & 1;
-    pos_--;
-    if (pos_ < 0 && !input_->eof()) {
-        RefreshState();
+bool HasFFByte(uint64_t word) {
+    uint64_t inv = ~word;
+    return ((inv - 0x0101010101010101ull) & ~inv & 0x8080808080808080ull) != 0;
+}
+}  // namespace
+
+BitReader::BitReader(std::istream& input) {
+    Reset(input);
+}
+
+BitReader::BitReader(std::span<const Byte> data) {
+    Reset(data);
+}
+
+void BitReader::Reset(std::istream& input) {
+    Reset(std::span<const Byte>());
+    input_ = &input;
+    storage_.resize(kBufferSize);
+    buffer_ = storage_.data();
+}
+
+void BitReader::Reset(std::span<const Byte> data) {
+    input_ = nullptr;
+    appending_ = false;
+    buffer_ = data.data();
+    buffer_pos_ = 0;
+    buffer_end_ = data.size();
+    discarded_ = 0;
+    acc_ = 0;
+    bits_ = 0;
+    is_sos_ = false;
+    hit_marker_ = false;
+}
+
+void BitReader::ResetAppendable() {
+    Reset(std::span<const Byte>());
+    storage_.clear();
+    buffer_ = storage_.data();
+    appending_ = true;
+}
+
+void BitReader::Append(std::span<const Byte> data) {
+    if (!appending_) {
+        throw std::logic_error("appending to a closed input");
     }
-    return res;
+    discarded_ += buffer_pos_;
+    storage_.erase(storage_.begin(), storage_.begin() + buffer_pos_);
+    storage_.insert(storage_.end(), data.begin(), data.end());
+    buffer_ = storage_.data();
+    buffer_pos_ = 0;
+    buffer_end_ = storage_.size();
+}
+
+void BitReader::Close() {
+    appending_ = false;
+}
+
+bool BitReader::ReadBit() {
+    return ReadBits(1);
 }
 
 DByte BitReader::ReadDByte() {
@@ -24,12 +84,10 @@ DByte BitReader::ReadDByte() {
 }
 
 Byte BitReader::ReadByte() {
-    Byte res = 0;
-    for (int i = 0; i < 8; i++) {
-        res <<= 1;
-        res |= ReadBit();
+    if (bits_ == 0 && !is_sos_) {
+        return NextByte();
     }
-    return res;
+    return ReadBits(8);
 }
 
 Marker BitReader::ReadMarker() {
@@ -57,14 +115,29 @@ std::vector<DByte> BitReader::ReadNDBytes(size_t n) {
 }
 
 std::vector<Byte> BitReader::ReadNBytes(size_t n) {
-    std::vector<Byte> res;
-    res.reserve(n);
-    while (n--) {
-        res.emplace_back(ReadByte());
-    }
+    std::vector<Byte> res(n);
+    ReadNBytes(res);
     return res;
 }
 
+void BitReader::ReadNBytes(std::span<Byte> out) {
+    if (bits_ != 0 || is_sos_) {
+        for (Byte& cur : out) {
+            cur = ReadByte();
+        }
+        return;
+    }
+    for (size_t done = 0; done < out.size();) {
+        if (buffer_pos_ == buffer_end_ && !Require(1)) {
+            throw std::runtime_error("reading from an empty input");
+        }
+        size_t chunk = std::min(out.size() - done, buffer_end_ - buffer_pos_);
+        std::memcpy(out.data() + done, buffer_ + buffer_pos_, chunk);
+        buffer_pos_ += chunk;
+        done += chunk;
+    }
+}
+
 uint8_t BitReader::ReadRawDataLen(HuffmanTree& tree) {
     int out;
     while (true) {
@@ -77,43 +150,183 @@ uint8_t BitReader::ReadRawDataLen(HuffmanTree& tree) {
 }
 
 int BitReader::ReadRawDataItem(uint8_t len) {
-    if (len == 0) {
-        return 0;
-    }
-    int real = ReadBit();
-    bool invert = !real;
-    for (int i = 1; i < len; i++) {
-        real = (real << 1) | ReadBit();
-    }
-    if (invert) {
-        real = real - (1 << len) + 1;
+    return ReceiveExtend(len);
+}
+
+int BitReader::DecodeHuffmanLong(const HuffmanTree& tree) {
+    int len, value;
+    if (!tree.DecodeLong(Peek(kHuffmanMaxCodeLen), len, value)) {
+        throw std::runtime_error("wrong huffman code");
     }
-    return real;
+    Consume(len);
+    return value;
 }
 
 void BitReader::SkipCurrentByte() {
-    if (pos_ != 7) {
-        pos_ = -1;
-        //            RefreshState();
-    }
+    Consume(bits_ % 8);
 }
 
 void BitReader::SetIsSos(bool is_sos) {
+    if (is_sos_ && !is_sos) {
+        // whatever is left in the accumulator is padding before the marker
+        acc_ = 0;
+        bits_ = 0;
+    }
     is_sos_ = is_sos;
+    hit_marker_ = false;
 }
 
-void BitReader::RefreshState() {
-    if (input_->eof()) {
-        throw std::runtime_error("reading from an empty input");
+std::span<const Byte> BitReader::ReadScanData() {
+    if (bits_ != 0 || is_sos_) {
+        throw std::logic_error("ReadScanData in the middle of the bit stream");
     }
-    Byte tmp;
-    *input_ >> tmp;
-    if (is_sos_ && tmp == 0 && last_ == 0xFF) {  // 0xFF + 0x00 means only FF
-        if (input_->eof()) {
+    // data in memory is returned in place, a stream is copied to scan_data_
+    size_t begin = buffer_pos_;
+    scan_data_.clear();
+    auto append = [&](size_t end) {
+        if (input_) {
+            scan_data_.insert(scan_data_.end(), buffer_ + buffer_pos_, buffer_ + end);
+        }
+        buffer_pos_ = end;
+    };
+    while (true) {
+        if (buffer_pos_ == buffer_end_ && !Require(1)) {
+            break;
+        }
+        const Byte* ff = static_cast<const Byte*>(
+            std::memchr(buffer_ + buffer_pos_, 0xff, buffer_end_ - buffer_pos_));
+        if (!ff) {
+            append(buffer_end_);
+            continue;
+        }
+        append(ff - buffer_);
+        if (buffer_end_ - buffer_pos_ < 2 && !Require(2)) {
+            append(buffer_end_);
+            break;
+        }
+        Byte next = buffer_[buffer_pos_ + 1];
+        if (next != 0 && (next < 0xd0 || next > 0xd7)) {
+            break;
+        }
+        append(buffer_pos_ + 2);
+    }
+    if (input_) {
+        return scan_data_;
+    }
+    return {buffer_ + begin, buffer_pos_ - begin};
+}
+
+void BitReader::Skip(size_t n) {
+    if (bits_ != 0 || is_sos_) {
+        while (n--) {
+            ReadByte();
+        }
+        return;
+    }
+    // what is not buffered yet is seeked over if the stream can do it, a pipe can't
+    size_t buffered = buffer_end_ - buffer_pos_;
+    if (input_ && n > buffered && input_->good()) {
+        auto rest = static_cast<std::streamoff>(n - buffered);
+        if (input_->rdbuf()->pubseekoff(rest, std::ios::cur, std::ios::in) !=
+            std::streampos(std::streamoff(-1))) {
+            discarded_ += buffer_end_ + rest;
+            buffer_pos_ = buffer_end_ = 0;
+            return;
+        }
+    }
+    while (n > 0) {
+        if (buffer_pos_ == buffer_end_ && !Require(1)) {
             throw std::runtime_error("reading from an empty input");
         }
-        *input_ >> tmp;
+        size_t chunk = std::min(n, buffer_end_ - buffer_pos_);
+        buffer_pos_ += chunk;
+        n -= chunk;
+    }
+}
+
+void BitReader::Refill(int n) {
+    if (is_sos_) {
+        RefillEntropy();
+        return;
+    }
+    // outside of the scan data don't read ahead: the caller may switch to SOS mode
+    while (bits_ < n) {
+        acc_ |= static_cast<uint64_t>(NextByte()) << (56 - bits_);
+        bits_ += 8;
+    }
+}
+
+void BitReader::RefillEntropy() {
+    while (bits_ <= 56) {
+        if (hit_marker_) {
+            bits_ += (64 - bits_) & ~7;
+            return;
+        }
+        if (buffer_end_ - buffer_pos_ >= sizeof(uint64_t) || FillBuffer(sizeof(uint64_t))) {
+            uint64_t word = LoadBigEndian64(buffer_ + buffer_pos_);
+            if (!HasFFByte(word)) {
+                int count = (64 - bits_) / 8;
+                acc_ |= word >> (64 - 8 * count) << (64 - bits_ - 8 * count);
+                bits_ += 8 * count;
+                buffer_pos_ += count;
+                continue;
+            }
+        }
+
+        if (buffer_pos_ == buffer_end_ && !Require(1)) {
+            hit_marker_ = true;
+            continue;
+        }
+        Byte cur = buffer_[buffer_pos_];
+        if (cur == 0xff) {
+            if (buffer_end_ - buffer_pos_ < 2 && !Require(2)) {
+                hit_marker_ = true;
+                continue;
+            }
+            if (buffer_[buffer_pos_ + 1] != 0) {
+                // the marker is left in the buffer for ReadMarker
+                hit_marker_ = true;
+                continue;
+            }
+            buffer_pos_++;  // 0xFF + 0x00 means only FF
+        }
+        buffer_pos_++;
+        acc_ |= static_cast<uint64_t>(cur) << (56 - bits_);
+        bits_ += 8;
+    }
+}
+
+bool BitReader::FillBuffer(size_t need) {
+    if (!input_) {
+        return buffer_end_ - buffer_pos_ >= need;
+    }
+    if (buffer_pos_ > 0) {
+        discarded_ += buffer_pos_;
+        std::memmove(storage_.data(), storage_.data() + buffer_pos_, buffer_end_ - buffer_pos_);
+        buffer_end_ -= buffer_pos_;
+        buffer_pos_ = 0;
+    }
+    while (buffer_end_ < need && input_->good()) {
+        input_->read(reinterpret_cast<char*>(storage_.data() + buffer_end_),
+                     storage_.size() - buffer_end_);
+        buffer_end_ += input_->gcount();
+    }
+    return buffer_end_ >= need;
+}
+
+bool BitReader::Require(size_t need) {
+    if (FillBuffer(need)) {
+        return true;
+    }
+    if (appending_) {
+        throw OutOfData();
+    }
+    return false;
+}
+
+Byte BitReader::NextByte() {
+    if (buffer_pos_ == buffer_end_ && !Require(1)) {
+        throw std::runtime_error("reading from an empty input");
     }
-    last_ = tmp;
-    pos_ = 7;
+    return buffer_[buffer_pos_++];
 }
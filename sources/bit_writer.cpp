@@ -0,0 +1,19 @@
+#include "bit_writer.h"
+
+void BitWriter::Finish() {
+    if (size_ % 8 != 0) {
+        Write(0xff, 8 - size_ % 8);
+    }
+    Flush();
+}
+
+void BitWriter::Flush() {
+    while (size_ >= 8) {
+        size_ -= 8;
+        Byte byte = acc_ >> size_;
+        out_.push_back(byte);
+        if (byte == 0xff) {
+            out_.push_back(0);
+        }
+    }
+}
@@ -0,0 +1,303 @@
+#include <color.h>
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define JPEG_DECODER_X86
+#endif
+
+namespace {
+constexpr int kColorBits = 14;
+constexpr int16_t kHalf = 1 << (kColorBits - 1);
+
+constexpr int16_t FixColor(double x) {
+    return static_cast<int16_t>(x * (1 << kColorBits) + 0.5);
+}
+
+constexpr int16_t kCrR = FixColor(1.402);
+constexpr int16_t kCbG = FixColor(0.34414);
+constexpr int16_t kCrG = FixColor(0.71414);
+constexpr int16_t kCbB = FixColor(1.772);
+
+Byte Clamp(int x) {
+    return std::clamp(x, 0, 255);
+}
+
+template <PixelFormat kFormat>
+void StorePixel(Byte* out, Byte r, Byte g, Byte b) {
+    if constexpr (kFormat == PixelFormat::kBGR8) {
+        out[0] = b, out[1] = g, out[2] = r;
+    } else if constexpr (kFormat == PixelFormat::kGray8) {
+        out[0] = r;
+    } else {
+        out[0] = r, out[1] = g, out[2] = b;
+        if constexpr (kFormat == PixelFormat::kRGBA8) {
+            out[3] = 255;
+        }
+    }
+}
+
+template <PixelFormat kFormat>
+void ConvertScalar(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count) {
+    for (size_t i = 0; i < count; i++, out += BytesPerPixel(kFormat)) {
+        int cur_cb = cb[i] - 128, cur_cr = cr[i] - 128;
+        int r = y[i] + ((kCrR * cur_cr + kHalf) >> kColorBits);
+        int g = y[i] + ((-kCbG * cur_cb - kCrG * cur_cr + kHalf) >> kColorBits);
+        int b = y[i] + ((kCbB * cur_cb + kHalf) >> kColorBits);
+        StorePixel<kFormat>(out, Clamp(r), Clamp(g), Clamp(b));
+    }
+}
+
+template <PixelFormat kFormat>
+void GrayScalar(const Byte* y, Byte* out, size_t count) {
+    for (size_t i = 0; i < count; i++, out += BytesPerPixel(kFormat)) {
+        StorePixel<kFormat>(out, y[i], y[i], y[i]);
+    }
+}
+
+// Runs |Function<format>| for a format known only at run time.
+#define DISPATCH_FORMAT(format, Function, ...)                  \
+    switch (format) {                                           \
+        case PixelFormat::kRGB8:                                \
+            Function<PixelFormat::kRGB8>(__VA_ARGS__);          \
+            break;                                              \
+        case PixelFormat::kRGBA8:                               \
+            Function<PixelFormat::kRGBA8>(__VA_ARGS__);         \
+            break;                                              \
+        case PixelFormat::kBGR8:                                \
+            Function<PixelFormat::kBGR8>(__VA_ARGS__);          \
+            break;                                              \
+        case PixelFormat::kGray8:                               \
+            Function<PixelFormat::kGray8>(__VA_ARGS__);         \
+            break;                                              \
+    }
+
+#ifdef JPEG_DECODER_X86
+// 8 pixels: y, cb and cr are 16-bit lanes, cb and cr already centered around zero.
+// (x, 1) pairs multiplied by (c, kHalf) give c * x + kHalf in one pmaddwd.
+void ConvertSse2(__m128i y, __m128i cb, __m128i cr, __m128i& r, __m128i& g, __m128i& b) {
+    __m128i one = _mm_set1_epi16(1);
+    __m128i half = _mm_set1_epi32(kHalf);
+    __m128i k_r = _mm_set_epi16(kHalf, kCrR, kHalf, kCrR, kHalf, kCrR, kHalf, kCrR);
+    __m128i k_g = _mm_set_epi16(-kCrG, -kCbG, -kCrG, -kCbG, -kCrG, -kCbG, -kCrG, -kCbG);
+    __m128i k_b = _mm_set_epi16(kHalf, kCbB, kHalf, kCbB, kHalf, kCbB, kHalf, kCbB);
+
+    auto product = [](__m128i lo, __m128i hi, __m128i k, __m128i bias) {
+        return _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, k), bias), kColorBits),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, k), bias), kColorBits));
+    };
+    __m128i zero = _mm_setzero_si128();
+    r = _mm_add_epi16(y, product(_mm_unpacklo_epi16(cr, one), _mm_unpackhi_epi16(cr, one), k_r,
+                                 zero));
+    g = _mm_add_epi16(y, product(_mm_unpacklo_epi16(cb, cr), _mm_unpackhi_epi16(cb, cr), k_g,
+                                 half));
+    b = _mm_add_epi16(y, product(_mm_unpacklo_epi16(cb, one), _mm_unpackhi_epi16(cb, one), k_b,
+                                 zero));
+}
+
+template <PixelFormat kFormat>
+void ConvertRowSse2(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count) {
+    constexpr size_t kStep = 16;
+    constexpr size_t kPixelSize = BytesPerPixel(kFormat);
+    __m128i zero = _mm_setzero_si128(), center = _mm_set1_epi16(128);
+    size_t i = 0;
+    for (; i + kStep <= count; i += kStep, out += kStep * kPixelSize) {
+        __m128i y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+        __m128i cb8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cb + i));
+        __m128i cr8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cr + i));
+        __m128i r[2], g[2], b[2];
+        ConvertSse2(_mm_unpacklo_epi8(y8, zero), _mm_sub_epi16(_mm_unpacklo_epi8(cb8, zero), center),
+                    _mm_sub_epi16(_mm_unpacklo_epi8(cr8, zero), center), r[0], g[0], b[0]);
+        ConvertSse2(_mm_unpackhi_epi8(y8, zero), _mm_sub_epi16(_mm_unpackhi_epi8(cb8, zero), center),
+                    _mm_sub_epi16(_mm_unpackhi_epi8(cr8, zero), center), r[1], g[1], b[1]);
+        __m128i r8 = _mm_packus_epi16(r[0], r[1]);
+        __m128i g8 = _mm_packus_epi16(g[0], g[1]);
+        __m128i b8 = _mm_packus_epi16(b[0], b[1]);
+
+        if constexpr (kFormat == PixelFormat::kRGBA8) {
+            __m128i alpha = _mm_set1_epi8(-1);
+            __m128i rg_lo = _mm_unpacklo_epi8(r8, g8), rg_hi = _mm_unpackhi_epi8(r8, g8);
+            __m128i ba_lo = _mm_unpacklo_epi8(b8, alpha), ba_hi = _mm_unpackhi_epi8(b8, alpha);
+            __m128i* dst = reinterpret_cast<__m128i*>(out);
+            _mm_storeu_si128(dst, _mm_unpacklo_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+            _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+        } else {
+            // SSE2 has no byte shuffle, three channels are interleaved by hand
+            alignas(16) Byte channels[3][kStep];
+            _mm_store_si128(reinterpret_cast<__m128i*>(channels[0]), r8);
+            _mm_store_si128(reinterpret_cast<__m128i*>(channels[1]), g8);
+            _mm_store_si128(reinterpret_cast<__m128i*>(channels[2]), b8);
+            for (size_t j = 0; j < kStep; j++) {
+                StorePixel<kFormat>(out + j * kPixelSize, channels[0][j], channels[1][j],
+                                    channels[2][j]);
+            }
+        }
+    }
+    ConvertScalar<kFormat>(y + i, cb + i, cr + i, out, count - i);
+}
+
+#define JPEG_DECODER_AVX2 __attribute__((target("avx2")))
+
+JPEG_DECODER_AVX2 __m256i ProductAvx2(__m256i lo, __m256i hi, __m256i k, __m256i bias) {
+    return _mm256_packs_epi32(
+        _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(lo, k), bias), kColorBits),
+        _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(hi, k), bias), kColorBits));
+}
+
+// Same as ConvertSse2 for 16 pixels.
+JPEG_DECODER_AVX2 void ConvertAvx2(__m256i y, __m256i cb, __m256i cr, __m256i& r, __m256i& g,
+                                   __m256i& b) {
+    __m256i one = _mm256_set1_epi16(1);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i half = _mm256_set1_epi32(kHalf);
+    __m256i k_r = _mm256_set1_epi32(static_cast<uint16_t>(kCrR) | kHalf << 16);
+    __m256i k_g = _mm256_set1_epi32(static_cast<uint16_t>(-kCbG) | -kCrG * (1 << 16));
+    __m256i k_b = _mm256_set1_epi32(static_cast<uint16_t>(kCbB) | kHalf << 16);
+
+    r = _mm256_add_epi16(y, ProductAvx2(_mm256_unpacklo_epi16(cr, one),
+                                        _mm256_unpackhi_epi16(cr, one), k_r, zero));
+    g = _mm256_add_epi16(y, ProductAvx2(_mm256_unpacklo_epi16(cb, cr),
+                                        _mm256_unpackhi_epi16(cb, cr), k_g, half));
+    b = _mm256_add_epi16(y, ProductAvx2(_mm256_unpacklo_epi16(cb, one),
+                                        _mm256_unpackhi_epi16(cb, one), k_b, zero));
+}
+
+template <PixelFormat kFormat>
+JPEG_DECODER_AVX2 void ConvertRowAvx2(const Byte* y, const Byte* cb, const Byte* cr, Byte* out,
+                                      size_t count) {
+    constexpr size_t kStep = 32;
+    constexpr size_t kPixelSize = BytesPerPixel(kFormat);
+    __m256i zero = _mm256_setzero_si256(), center = _mm256_set1_epi16(128);
+    __m256i alpha = _mm256_set1_epi8(-1);
+    // drops the alpha bytes of four RGBA pixels (and swaps R and B for BGR)
+    __m256i pack = kFormat == PixelFormat::kBGR8
+                       ? _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2,
+                                          1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+                       : _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0,
+                                          1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + kStep <= count; i += kStep, out += kStep * kPixelSize) {
+        __m256i y8 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i));
+        __m256i cb8 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cb + i));
+        __m256i cr8 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cr + i));
+        __m256i r[2], g[2], b[2];
+        ConvertAvx2(_mm256_unpacklo_epi8(y8, zero),
+                    _mm256_sub_epi16(_mm256_unpacklo_epi8(cb8, zero), center),
+                    _mm256_sub_epi16(_mm256_unpacklo_epi8(cr8, zero), center), r[0], g[0], b[0]);
+        ConvertAvx2(_mm256_unpackhi_epi8(y8, zero),
+                    _mm256_sub_epi16(_mm256_unpackhi_epi8(cb8, zero), center),
+                    _mm256_sub_epi16(_mm256_unpackhi_epi8(cr8, zero), center), r[1], g[1], b[1]);
+        __m256i r8 = _mm256_packus_epi16(r[0], r[1]);
+        __m256i g8 = _mm256_packus_epi16(g[0], g[1]);
+        __m256i b8 = _mm256_packus_epi16(b[0], b[1]);
+
+        // unpacks work within 128-bit lanes, the permutes restore the pixel order
+        __m256i rg_lo = _mm256_unpacklo_epi8(r8, g8), rg_hi = _mm256_unpackhi_epi8(r8, g8);
+        __m256i ba_lo = _mm256_unpacklo_epi8(b8, alpha), ba_hi = _mm256_unpackhi_epi8(b8, alpha);
+        __m256i px0 = _mm256_unpacklo_epi16(rg_lo, ba_lo), px1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);
+        __m256i px2 = _mm256_unpacklo_epi16(rg_hi, ba_hi), px3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);
+        __m256i rgba[4] = {
+            _mm256_permute2x128_si256(px0, px1, 0x20), _mm256_permute2x128_si256(px2, px3, 0x20),
+            _mm256_permute2x128_si256(px0, px1, 0x31), _mm256_permute2x128_si256(px2, px3, 0x31)};
+
+        if constexpr (kFormat == PixelFormat::kRGBA8) {
+            for (int j = 0; j < 4; j++) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out) + j, rgba[j]);
+            }
+        } else {
+            // every 16-byte store writes 12 useful bytes, the last one goes through a
+            // buffer not to write past the row
+            alignas(16) Byte last[16];
+            for (int j = 0; j < 4; j++) {
+                __m256i packed = _mm256_shuffle_epi8(rgba[j], pack);
+                Byte* dst = out + j * 24;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(packed));
+                if (j < 3) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 12),
+                                     _mm256_extracti128_si256(packed, 1));
+                } else {
+                    _mm_store_si128(reinterpret_cast<__m128i*>(last),
+                                    _mm256_extracti128_si256(packed, 1));
+                    std::memcpy(dst + 12, last, 12);
+                }
+            }
+        }
+    }
+    ConvertScalar<kFormat>(y + i, cb + i, cr + i, out, count - i);
+}
+#endif
+
+template <PixelFormat kFormat>
+void ConvertRowScalar(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count) {
+    ConvertScalar<kFormat>(y, cb, cr, out, count);
+}
+}  // namespace
+
+namespace color {
+void YCbCrToRgbRowScalar(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count,
+                         PixelFormat format) {
+    if (format == PixelFormat::kGray8) {
+        std::memcpy(out, y, count);
+        return;
+    }
+    DISPATCH_FORMAT(format, ConvertRowScalar, y, cb, cr, out, count);
+}
+
+#ifdef JPEG_DECODER_X86
+void YCbCrToRgbRowSse2(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count,
+                       PixelFormat format) {
+    if (format == PixelFormat::kGray8) {
+        std::memcpy(out, y, count);
+        return;
+    }
+    DISPATCH_FORMAT(format, ConvertRowSse2, y, cb, cr, out, count);
+}
+
+void YCbCrToRgbRowAvx2(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count,
+                       PixelFormat format) {
+    if (format == PixelFormat::kGray8) {
+        std::memcpy(out, y, count);
+        return;
+    }
+    DISPATCH_FORMAT(format, ConvertRowAvx2, y, cb, cr, out, count);
+}
+#else
+void YCbCrToRgbRowSse2(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count,
+                       PixelFormat format) {
+    YCbCrToRgbRowScalar(y, cb, cr, out, count, format);
+}
+
+void YCbCrToRgbRowAvx2(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count,
+                       PixelFormat format) {
+    YCbCrToRgbRowScalar(y, cb, cr, out, count, format);
+}
+#endif
+
+void YCbCrToRgbRow(const Byte* y, const Byte* cb, const Byte* cr, Byte* out, size_t count,
+                   PixelFormat format) {
+    using RowFunction = void (*)(const Byte*, const Byte*, const Byte*, Byte*, size_t, PixelFormat);
+    static const RowFunction kFunction = [] {
+#ifdef JPEG_DECODER_X86
+        if (__builtin_cpu_supports("avx2")) {
+            return YCbCrToRgbRowAvx2;
+        }
+        return YCbCrToRgbRowSse2;
+#else
+        return YCbCrToRgbRowScalar;
+#endif
+    }();
+    kFunction(y, cb, cr, out, count, format);
+}
+
+void GrayRow(const Byte* y, Byte* out, size_t count, PixelFormat format) {
+    if (format == PixelFormat::kGray8) {
+        std::memcpy(out, y, count);
+        return;
+    }
+    DISPATCH_FORMAT(format, GrayScalar, y, out, count);
+}
+}  // namespace color
@@ -2,4 +2,6 @@
 
 const std::unordered_map<int, Marker> kCode2Marker = {
     {0xffd8, SOI},  {0xffd9, EOI}, {0xfffe, COM}, {0xffdb, DQT},
-    {0xffc0, SOF0}, {0xffc4, DHT}, {0xffda, SOS}};
+    {0xffc0, SOF0}, {0xffc2, SOF2}, {0xffc4, DHT}, {0xffda, SOS}, {0xffdd, DRI},
+    {0xffd0, RSTn}, {0xffd1, RSTn}, {0xffd2, RSTn}, {0xffd3, RSTn},
+    {0xffd4, RSTn}, {0xffd5, RSTn}, {0xffd6, RSTn}, {0xffd7, RSTn}};
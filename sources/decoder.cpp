@@ -1,33 +1,82 @@
 #include <iostream>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <span>
 
 #include "bit_reader.h"
+#include "color.h"
 #include "constants.h"
 #include "decoder.h"
-#include "fft.h"
 #include "huffman.h"
+#include "huffman_cache.h"
+#include "idct.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "types.h"
 #include "utils.h"
 
-struct YCbCr {
-    int y, cb, cr;
-
-    YCbCr(int y, int cb, int cr) : y(y), cb(cb), cr(cr) {
+DecodeStats& DecodeStats::operator+=(const DecodeStats& other) {
+    for (const auto& [name, bytes] : other.segment_bytes) {
+        segment_bytes[name] += bytes;
     }
+    entropy_coded_bytes += other.entropy_coded_bytes;
+    huffman_symbols += other.huffman_symbols;
+    mcus += other.mcus;
+    blocks += other.blocks;
+    dc_only_blocks += other.dc_only_blocks;
+    parse_ns += other.parse_ns;
+    entropy_ns += other.entropy_ns;
+    idct_ns += other.idct_ns;
+    color_ns += other.color_ns;
+    output_ns += other.output_ns;
+    return *this;
+}
 
-    RGB ToRGB() const {
-        RGB res{};
+// Every thread counts into its own DecodeStats, they are added to the one of the caller
+// when the thread is done. |segment_bytes| are indexed by Marker.
+void AddStats(DecodeStats* to, const DecodeStats& from,
+              std::span<const size_t> segment_bytes = {}) {
+    if (!kDecodeStatsEnabled || !to) {
+        return;
+    }
+    static std::mutex mutex;
+    std::lock_guard lock(mutex);
+    *to += from;
+    for (size_t marker = 0; marker < segment_bytes.size(); marker++) {
+        if (segment_bytes[marker] != 0) {
+            to->segment_bytes[utils::ToString(static_cast<Marker>(marker))] +=
+                segment_bytes[marker];
+        }
+    }
+}
 
-        res.r = round(y + 1.402 * (cr - 128));
-        res.g = round(y - 0.34414 * (cb - 128) - 0.71414 * (cr - 128));
-        res.b = round(y + 1.772 * (cb - 128));
-        res.r = std::min(255, std::max(0, res.r));
-        res.g = std::min(255, std::max(0, res.g));
-        res.b = std::min(255, std::max(0, res.b));
+// Adds the time until the end of the scope to |ns|, compiled out with the stats.
+class StageTimer {
+public:
+    explicit StageTimer(uint64_t& ns) : ns_(ns) {
+        if constexpr (kDecodeStatsEnabled) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
 
-        return res;
+    ~StageTimer() {
+        if constexpr (kDecodeStatsEnabled) {
+            ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start_)
+                       .count();
+        }
     }
+
+private:
+    uint64_t& ns_;
+    std::chrono::steady_clock::time_point start_;
 };
 
 struct Channel {
@@ -37,25 +86,46 @@ struct Channel {
 
 struct QuantizationTable {
     int id;
-    std::vector<DByte> items;
-
-    QuantizationTable(int id, const std::vector<DByte>& items) : id(id), items(items) {
-    }
+    std::array<DByte, kFullBlock> items;  // in zigzag order
+    std::array<DByte, kFullBlock> natural;  // the same in natural order
 };
 
 struct HuffmanTable {
     int cl, id;
-    HuffmanTree tree;
-
-    HuffmanTable(int cl, int id, HuffmanTree&& tree) : cl(cl), id(id), tree(std::move(tree)) {
-    }
+    // shared with the other images using the same table
+    std::shared_ptr<const HuffmanTree> tree;
+    // as DHT gives them, for DecodeCoefficients
+    std::array<Byte, kHuffmanMaxCodeLen> counts;
+    std::array<Byte, 256> values;
 };
 
+// DC predictors of the components of a scan.
+using DcPredictors = std::array<int, kMaxComponents>;
+
 struct MetaDataHandler {
-    size_t height, width;
+    size_t height = 0, width = 0;
+    size_t restart_interval = 0;  // in MCUs, 0 if there are no restart markers
+    bool progressive = false;
     std::vector<Channel> channels;
     std::vector<HuffmanTable> huffs;
     std::vector<QuantizationTable> dqt_tables;
+    std::string comment;
+    // counters of the work done by the calling thread, bytes of the segments by Marker
+    DecodeStats stats;
+    std::array<size_t, RSTn + 1> segment_bytes{};
+
+    // Forgets the image, but keeps the memory for the next one.
+    void Clear() {
+        height = width = 0;
+        restart_interval = 0;
+        progressive = false;
+        channels.clear();
+        huffs.clear();
+        dqt_tables.clear();
+        comment.clear();
+        stats = {};
+        segment_bytes.fill(0);
+    }
 
     std::pair<int, int> MaxThinning() const {
         int hor = std::max_element(channels.begin(), channels.end(), [](auto l, auto r) {
@@ -79,7 +149,7 @@ struct MetaDataHandler {
         return dqt_tables[res];
     }
 
-    HuffmanTree& FindHuffmanTreeForChannel(int chan, int cl) {
+    const HuffmanTree& FindHuffmanTreeForChannel(int chan, int cl) const {
         size_t res = std::find_if(huffs.begin(), huffs.end(),
                                   [&](const HuffmanTable& table) {
                                       return table.cl == cl &&
@@ -90,10 +160,11 @@ struct MetaDataHandler {
         if (res == huffs.size()) {
             throw std::runtime_error("can't find desired huffman table");
         }
-        return huffs[res].tree;
+        return *huffs[res].tree;
     }
 
-    void SetHuffmanACDCIndex(int id, int huffman_ids) {
+    // Returns the index of the channel.
+    size_t SetHuffmanACDCIndex(int id, int huffman_ids) {
         size_t i = std::find_if(channels.begin(), channels.end(),
                                 [id](const Channel& c) { return c.id == id; }) -
                    channels.begin();
@@ -102,300 +173,1946 @@ struct MetaDataHandler {
         }
         channels[i].huffman_dc = huffman_ids >> 4;
         channels[i].huffman_ac = huffman_ids & 0xf;
+        return i;
     }
 };
 
-class MyDctCalculator {
-public:
-    MyDctCalculator()
-        : input_(kFullBlock), output_(kFullBlock), calculator_(kBlockSize, &input_, &output_) {
-    }
-
-    template <class BidirectionalIterator>
-    void LoadZigZagInput(BidirectionalIterator data_begin) {
-        utils::Vector2ZigZagFlatten(data_begin, input_);
-    }
-
-    template <class T>
-    void LoadInput(const std::vector<T>& new_input) {
-        for (int i = 0; i < kFullBlock; i++) {
-            input_[i] = new_input[i];
-        }
-    }
-
-    void Inverse() {
-        calculator_.Inverse();
-    }
-
-    const std::vector<double>* GetOutput() const {
-        return &output_;
-    }
-
-private:
-    std::vector<double> input_, output_;
-    DctCalculator calculator_;
-};
-
-std::vector<QuantizationTable> ReadQuantizationTables(BitReader& reader, DByte len) {
-    std::vector<QuantizationTable> res;
+// Tables of a DQT segment replace the ones with the same id.
+void ReadQuantizationTables(BitReader& reader, DByte len, MetaDataHandler& metainfo) {
     while (len > 0) {
         Byte info = reader.ReadByte();
         len--;
         int val_len = info >> 4 & 0xf;
         int id = info & 0xf;
 
-        std::vector<DByte> data;
-        if (val_len == 1) {
-            data = reader.ReadNDBytes(kFullBlock);
-            len -= kFullBlock * 2;
-        } else {
-            data.reserve(len);
-            for (int i = 0; i < kFullBlock; i++) {
-                data.push_back(reader.ReadByte());
-                len--;
-            }
+        auto it = std::find_if(metainfo.dqt_tables.begin(), metainfo.dqt_tables.end(),
+                               [&](const QuantizationTable& table) { return table.id == id; });
+        QuantizationTable& table =
+            it != metainfo.dqt_tables.end() ? *it : metainfo.dqt_tables.emplace_back();
+        table.id = id;
+        for (DByte& item : table.items) {
+            item = val_len == 1 ? reader.ReadDByte() : reader.ReadByte();
         }
-
-        res.emplace_back(id, data);
+        for (int i = 0; i < kFullBlock; i++) {
+            table.natural[kNaturalOrder[i]] = table.items[i];
+        }
+        len -= val_len == 1 ? kFullBlock * 2 : kFullBlock;
     }
-    return res;
 }
 
-std::vector<HuffmanTable> ReadHuffmanTables(BitReader& reader, DByte len) {
-    std::vector<HuffmanTable> res;
+// Same for DHT: progressive images redefine tables between the scans.
+void ReadHuffmanTables(BitReader& reader, DByte len, MetaDataHandler& metainfo) {
     while (len > 0) {
         Byte info = reader.ReadByte();
         int cl = info >> 4;
         int id = info & 0xf;
         len--;
-        std::vector<Byte> lens(16);
+        auto it = std::find_if(
+            metainfo.huffs.begin(), metainfo.huffs.end(),
+            [&](const HuffmanTable& table) { return table.cl == cl && table.id == id; });
+        HuffmanTable& table = it != metainfo.huffs.end() ? *it : metainfo.huffs.emplace_back();
+        table.cl = cl;
+        table.id = id;
+
         int total = 0;
-        for (auto& i : lens) {
+        for (auto& i : table.counts) {
             i = reader.ReadByte();
             total += i;
             len--;
         }
+        if (total > static_cast<int>(table.values.size())) {
+            throw std::runtime_error("too many values in DHT");
+        }
+        std::span<Byte> values(table.values.data(), total);
+        reader.ReadNBytes(values);
+        len -= total;
+        table.tree = HuffmanCache::Global().Get(table.counts, values);
+    }
+}
 
-        std::vector<Byte> values;
-        values.reserve(total);
+// Dequantizes a block given in zigzag order and writes it in natural order to |coefs|.
+// Returns the zigzag index of its last non-zero coefficient.
+int Dequantize(const int16_t* zigzag, const QuantizationTable& table, int16_t* coefs) {
+    int last = kFullBlock - 1;
+    while (last > 0 && zigzag[last] == 0) {
+        last--;
+    }
+    std::fill_n(coefs, kFullBlock, 0);
+    for (int i = 0; i <= last; i++) {
+        int pos = kNaturalOrder[i];
+        coefs[pos] = std::clamp<int>(zigzag[i] * table.natural[pos], INT16_MIN, INT16_MAX);
+    }
+    return last;
+}
 
-        while (total--) {
-            values.push_back(reader.ReadByte());
-            len--;
+// Decodes the coefficients of one block to |out|. Without kDequantize they are written in
+// zigzag order as they are, with it they are multiplied by |table| and written in natural
+// order right away. Returns the zigzag index of the last non-zero coefficient, 0 if there
+// is only the DC.
+template <bool kDequantize>
+int DecodeBlock(BitReader& reader, int& last_dc, const HuffmanTree& huffman_dc,
+                const HuffmanTree& huffman_ac, const QuantizationTable* table, int16_t* out,
+                DecodeStats& stats) {
+    auto store = [table, out](int ind, int value) {
+        if constexpr (kDequantize) {
+            int pos = kNaturalOrder[ind];
+            out[pos] = std::clamp<int>(value * table->natural[pos], INT16_MIN, INT16_MAX);
+        } else {
+            out[ind] = value;
+        }
+    };
+    std::fill_n(out, kFullBlock, 0);
+    // dc, the prediction is kept in 16 bits
+    last_dc = static_cast<int16_t>(last_dc +
+                                   reader.ReceiveExtend(reader.DecodeHuffman(huffman_dc)));
+    store(0, last_dc);
+    // ac
+    int symbols = 1, last = 0;
+    for (int ind = 1; ind < kFullBlock;) {
+        symbols++;
+        int run, value;
+        if (int fast = huffman_ac.LookupAc(reader.Peek(kHuffmanLookupBits)); fast != 0) {
+            // small coefficient: run/size and the value come from a single probe
+            reader.Consume(fast & 0xf);
+            run = fast >> 4 & 0xf;
+            value = fast >> 8;
+        } else {
+            int cur = reader.DecodeHuffman(huffman_ac);
+            if (cur == 0) {
+                break;
+            }
+            run = cur >> 4;
+            value = reader.ReceiveExtend(cur & 0xf);
+        }
+        ind += run;
+        if (ind >= kFullBlock) {
+            throw std::runtime_error("wrong AC coef in MCU");
+        }
+        if (value != 0) {  // ZRL has none
+            store(ind, value);
+            last = ind;
         }
-        HuffmanTree tree;
-        tree.Build(lens, values);
-        res.emplace_back(cl, id, std::move(tree));
+        ind++;
     }
+    if constexpr (kDecodeStatsEnabled) {
+        stats.huffman_symbols += symbols;
+        stats.blocks++;
+        stats.dc_only_blocks += last == 0;
+    }
+    return last;
+}
 
-    return res;
+// Reads a block outside of the decoded region: only the DC prediction is kept.
+void SkipNextMCU(BitReader& reader, int& last_dc, const HuffmanTree& huffman_dc,
+                 const HuffmanTree& huffman_ac, DecodeStats& stats) {
+    last_dc = static_cast<short>(last_dc + reader.ReceiveExtend(reader.DecodeHuffman(huffman_dc)));
+    int symbols = 1;
+    for (int ind = 1; ind < kFullBlock;) {
+        symbols++;
+        int run, size;
+        if (int fast = huffman_ac.LookupAc(reader.Peek(kHuffmanLookupBits)); fast != 0) {
+            reader.Consume(fast & 0xf);
+            run = fast >> 4 & 0xf;
+            size = 0;
+        } else {
+            int cur = reader.DecodeHuffman(huffman_ac);
+            if (cur == 0) {
+                break;
+            }
+            run = cur >> 4;
+            size = cur & 0xf;
+        }
+        ind += run;
+        if (ind >= kFullBlock) {
+            throw std::runtime_error("wrong AC coef in MCU");
+        }
+        ind++;
+        if (size != 0) {
+            reader.ReadBits(size);
+        }
+    }
+    if constexpr (kDecodeStatsEnabled) {
+        stats.huffman_symbols += symbols;
+        stats.blocks++;
+    }
+}
+
+size_t ScaledSize(size_t size, size_t scale) {
+    return (size + scale - 1) / scale;
 }
 
-ImageBlock<Byte, kBlockSize> ReadNextMCU(BitReader& reader, const QuantizationTable& table,
-                                         int& last_dc, HuffmanTree& huffman_dc,
-                                         HuffmanTree& huffman_ac, MyDctCalculator& calculator) {
-    static int ind = 0;
-    ind++;
+// Sampling factors and the MCU grid of a scan. Sizes in pixels are the ones of the output,
+// which is |scale| times smaller than the image.
+struct ScanLayout {
+    std::vector<std::pair<int, int>> sampling;
+    // block side of every channel after the transform, subsampled channels use a bigger
+    // transform when possible instead of being upsampled later
+    std::vector<size_t> block_sizes;
+    int hor = 1, ver = 1;
+    size_t width = 0, height = 0;
+    size_t mcu_width = 0, mcu_height = 0;
+    size_t mcus_x = 0, mcus_y = 0;
 
-    std::array<short, kFullBlock> raw_data;
-    size_t raw_data_ind = 0;
-    // dc
-    raw_data[raw_data_ind++] = reader.ReadRawDataItem(reader.ReadRawDataLen(huffman_dc));
-    // ac
-    while (raw_data_ind < kFullBlock) {
-        Byte cur = reader.ReadRawDataLen(huffman_ac);
-        if (cur == 0) {
+    // part of the output that is decoded and MCUs [mcu_x_begin, mcu_x_end) x
+    // [mcu_y_begin, mcu_y_end) covering it
+    Rect window{};
+    size_t mcu_x_begin = 0, mcu_x_end = 0, mcu_y_begin = 0, mcu_y_end = 0;
+
+    ScanLayout() = default;
+
+    ScanLayout(const MetaDataHandler& metainfo, const DecodeOptions& options) {
+        Reset(metainfo, options);
+    }
+
+    // Recomputes everything for another image, the vectors keep their memory.
+    void Reset(const MetaDataHandler& metainfo, const DecodeOptions& options) {
+        sampling.assign(metainfo.channels.size(), {1, 1});
+        block_sizes.clear();
+        hor = ver = 1;
+        width = ScaledSize(metainfo.width, options.scale);
+        height = ScaledSize(metainfo.height, options.scale);
+        size_t scale = options.scale;
+        // a scan of a single channel is not interleaved, its MCU is one block
+        if (metainfo.channels.size() > 1) {
+            for (size_t i = 0; i < metainfo.channels.size(); i++) {
+                sampling[i] = {metainfo.channels[i].horizontal, metainfo.channels[i].vertical};
+            }
+            std::tie(hor, ver) = metainfo.MaxThinning();
+        }
+        mcus_x = (metainfo.width + hor * kBlockSize - 1) / (hor * kBlockSize);
+        mcus_y = (metainfo.height + ver * kBlockSize - 1) / (ver * kBlockSize);
+        mcu_width = hor * kBlockSize / scale;
+        mcu_height = ver * kBlockSize / scale;
+        for (auto [cur_hor, cur_ver] : sampling) {
+            size_t enlarge = 1;
+            while (enlarge * 2 <= scale && hor % (cur_hor * enlarge * 2) == 0 &&
+                   ver % (cur_ver * enlarge * 2) == 0) {
+                enlarge *= 2;
+            }
+            block_sizes.push_back(kBlockSize / scale * enlarge);
+        }
+
+        window = {0, 0, width, height};
+        if (options.roi) {
+            window.x = std::min(options.roi->x, width);
+            window.y = std::min(options.roi->y, height);
+            window.width = std::min(options.roi->width, width - window.x);
+            window.height = std::min(options.roi->height, height - window.y);
+        }
+        mcu_x_begin = mcu_x_end = mcu_y_begin = mcu_y_end = 0;
+        if (window.width != 0 && window.height != 0) {
+            mcu_x_begin = window.x / mcu_width;
+            mcu_x_end = (window.x + window.width + mcu_width - 1) / mcu_width;
+            mcu_y_begin = window.y / mcu_height;
+            mcu_y_end = (window.y + window.height + mcu_height - 1) / mcu_height;
+        }
+    }
+
+    bool InWindow(size_t mcu_x, size_t mcu_y) const {
+        return mcu_x_begin <= mcu_x && mcu_x < mcu_x_end && mcu_y_begin <= mcu_y &&
+               mcu_y < mcu_y_end;
+    }
+
+    size_t McuCount() const {
+        return mcus_x * mcus_y;
+    }
+};
+
+// Repeats every sample of |src| kFactor times, only [first, first + count) of |out| is written.
+template <size_t kFactor>
+void UpsampleRow(const Byte* src, Byte* out, size_t first, size_t count) {
+    for (size_t x = first; x < first + count; x++) {
+        out[x] = src[x / kFactor];
+    }
+}
+
+// Decodes MCUs of one MCU row and turns them into pixels, every thread needs its own.
+// Coefficients of one MCU row, a plane per channel, and the zigzag index of the last
+// non-zero coefficient of every block.
+struct McuRowCoefficients {
+    std::vector<std::vector<int16_t>> coefs;
+    std::vector<std::vector<Byte>> last;
+};
+
+class McuRowDecoder {
+public:
+    McuRowDecoder() = default;
+
+    McuRowDecoder(const ScanLayout& layout, MetaDataHandler& metainfo,
+                  const DecodeOptions& options) {
+        Reset(layout, metainfo, options);
+    }
+
+    McuRowDecoder(const McuRowDecoder&) = delete;
+    McuRowDecoder& operator=(const McuRowDecoder&) = delete;
+
+    ~McuRowDecoder() {
+        FlushStats();
+    }
+
+    // Prepares the decoder for another image. Buffers that are big enough are kept, and so
+    // is the IDCT if its backend and batch don't change.
+    void Reset(const ScanLayout& layout, MetaDataHandler& metainfo, const DecodeOptions& options) {
+        layout_ = &layout;
+        width_ = layout.width;
+        height_ = layout.height;
+        channels_ = metainfo.channels.size();
+        // buffers of the channels an image doesn't have stay for the next one
+        if (row_.coefs.size() < channels_) {
+            row_.coefs.resize(channels_);
+            row_.last.resize(channels_);
+            planes_.resize(channels_);
+            block_outs_.resize(channels_);
+            strides_.resize(channels_);
+            column_maps_.resize(channels_);
+            hor_factors_.resize(channels_);
+            upsampled_.resize(channels_);
+        }
+        tables_.clear();
+        reduced_.clear();
+        decode_mcu_ = SelectKernel(layout);
+        FlushStats();
+        stats_target_ = options.stats;
+
+        // coefficients and pixels of one MCU row, a plane per channel
+        size_t max_blocks = 0;
+        for (size_t i = 0; i < channels_; i++) {
+            auto [cur_hor, cur_ver] = layout.sampling[i];
+            size_t blocks_x = layout.mcus_x * cur_hor;
+            size_t block_size = layout.block_sizes[i];
+            strides_[i] = blocks_x * block_size;
+            row_.coefs[i].resize(blocks_x * cur_ver * kFullBlock);
+            row_.last[i].resize(blocks_x * cur_ver);
+            planes_[i].resize(strides_[i] * cur_ver * block_size);
+            block_outs_[i].clear();
+            for (int v = 0; v < cur_ver; v++) {
+                for (size_t x = 0; x < blocks_x; x++) {
+                    block_outs_[i].push_back(planes_[i].data() + v * block_size * strides_[i] +
+                                             x * block_size);
+                }
+            }
+            max_blocks = std::max(max_blocks, block_outs_[i].size());
+
+            // progressive scans are entropy-decoded elsewhere, here only the pixels are made
+            if (metainfo.progressive) {
+                tables_.push_back({&metainfo.FindQTForChannel(i), nullptr, nullptr});
+            } else {
+                tables_.push_back({&metainfo.FindQTForChannel(i),
+                                   &metainfo.FindHuffmanTreeForChannel(i, 0),
+                                   &metainfo.FindHuffmanTreeForChannel(i, 1)});
+            }
+
+            // subsampled channels are stretched to full width row by row, the factors that
+            // are not 2 or 4 go through a map of columns
+            size_t plane_width = cur_hor * block_size;
+            hor_factors_[i] =
+                layout.mcu_width % plane_width == 0 ? layout.mcu_width / plane_width : 0;
+            column_maps_[i].clear();
+            if (hor_factors_[i] != 1) {
+                upsampled_[i].resize(width_);
+            }
+            if (hor_factors_[i] != 1 && hor_factors_[i] != 2 && hor_factors_[i] != 4) {
+                for (size_t x = 0; x < width_; x++) {
+                    column_maps_[i].push_back(x * plane_width / layout.mcu_width);
+                }
+            }
+
+            switch (block_size) {
+                case 4:
+                    reduced_.push_back(idct::InverseScalar4x4);
+                    break;
+                case 2:
+                    reduced_.push_back(idct::InverseScalar2x2);
+                    break;
+                case 1:
+                    reduced_.push_back(idct::InverseDc);
+                    break;
+                default:
+                    reduced_.push_back(nullptr);
+            }
+        }
+        // only FFTW plans depend on the batch
+        size_t batch = options.idct_batch ? options.idct_batch : max_blocks;
+        if (idct_batch_ == 0 || options.idct != idct_backend_ ||
+            (batch != idct_batch_ && idct_.Backend() == IdctBackend::kFftw)) {
+            idct_ = Idct(options.idct, batch);
+            idct_backend_ = options.idct;
+            idct_batch_ = batch;
+        }
+    }
+
+    // Adds the counters to DecodeOptions::stats of the image and starts them from zero.
+    void FlushStats() {
+        AddStats(stats_target_, stats_);
+        stats_ = {};
+        stats_target_ = nullptr;
+    }
+
+    // Counters of the work done by this decoder.
+    DecodeStats& Stats() {
+        return stats_;
+    }
+
+    // Coefficients of the current row, can be swapped with a buffer of the same shape.
+    McuRowCoefficients& Coefficients() {
+        return row_;
+    }
+
+    // Blocks of an MCU that is not |needed| are read, but not stored.
+    void DecodeMcu(BitReader& reader, size_t mcu_x, DcPredictors& prev_values,
+                   bool needed = true) {
+        if constexpr (kDecodeStatsEnabled) {
+            stats_.mcus++;
+        }
+        if (needed) {
+            (this->*decode_mcu_)(reader, mcu_x, prev_values);
+            return;
+        }
+        for (size_t i = 0; i < channels_; i++) {
+            auto [cur_hor, cur_ver] = layout_->sampling[i];
+            for (int block = 0; block < cur_hor * cur_ver; block++) {
+                SkipNextMCU(reader, prev_values[i], *tables_[i].dc, *tables_[i].ac, stats_);
+            }
+        }
+    }
+
+    // Fills the row of |channel| from quantized coefficients in zigzag order, |blocks| has
+    // the shape of the row. Only the blocks of MCUs inside of the window are taken.
+    void LoadCoefficients(size_t channel, const int16_t* blocks) {
+        auto [cur_hor, cur_ver] = layout_->sampling[channel];
+        size_t blocks_x = layout_->mcus_x * cur_hor;
+        for (int v = 0; v < cur_ver; v++) {
+            for (size_t x = layout_->mcu_x_begin * cur_hor; x < layout_->mcu_x_end * cur_hor; x++) {
+                size_t block = v * blocks_x + x;
+                row_.last[channel][block] =
+                    Dequantize(blocks + block * kFullBlock, *tables_[channel].dqt,
+                               row_.coefs[channel].data() + block * kFullBlock);
+            }
+        }
+    }
+
+    // Transforms MCUs [begin, end) of the decoded row and writes the pixels inside of the
+    // window to the MCU row |mcu_y| of |res|. |res| starts at the left edge of the window
+    // and the output row |first_row|.
+    void Output(Image& res, size_t mcu_y, size_t begin, size_t end, size_t first_row) {
+        begin = std::max(begin, layout_->mcu_x_begin);
+        end = std::min(end, layout_->mcu_x_end);
+        if (begin >= end || mcu_y < layout_->mcu_y_begin || mcu_y >= layout_->mcu_y_end) {
+            return;
+        }
+        Transform(begin, end);
+
+        StageTimer timer(stats_.color_ns);
+        PixelFormat format = res.Format();
+        const Rect& window = layout_->window;
+        size_t first_x = std::max(begin * layout_->mcu_width, window.x);
+        size_t count = std::min(end * layout_->mcu_width, window.x + window.width) - first_x;
+        size_t out_y = mcu_y * layout_->mcu_height;
+        for (size_t y = 0; y < layout_->mcu_height; y++) {
+            if (out_y + y < window.y) {
+                continue;
+            }
+            if (out_y + y >= window.y + window.height) {
+                break;
+            }
+            Byte* out = res.Row(out_y + y - first_row).data() +
+                        (first_x - window.x) * BytesPerPixel(format);
+            const Byte* rows[3];
+            for (size_t i = 0; i < channels_; i++) {
+                size_t plane_height = layout_->sampling[i].second * layout_->block_sizes[i];
+                const Byte* src =
+                    planes_[i].data() + y * plane_height / layout_->mcu_height * strides_[i];
+                if (hor_factors_[i] == 1) {
+                    rows[i] = src + first_x;
+                    continue;
+                }
+                Byte* upsampled = upsampled_[i].data();
+                if (hor_factors_[i] == 2) {
+                    UpsampleRow<2>(src, upsampled, first_x, count);
+                } else if (hor_factors_[i] == 4) {
+                    UpsampleRow<4>(src, upsampled, first_x, count);
+                } else {
+                    for (size_t x = first_x; x < first_x + count; x++) {
+                        upsampled[x] = src[column_maps_[i][x]];
+                    }
+                }
+                rows[i] = upsampled + first_x;
+            }
+            if (channels_ == 1 || format == PixelFormat::kGray8) {
+                color::GrayRow(rows[0], out, count, format);
+            } else {
+                color::YCbCrToRgbRow(rows[0], rows[1], rows[2], out, count, format);
+            }
+        }
+    }
+
+private:
+    using McuKernel = void (McuRowDecoder::*)(BitReader&, size_t, DcPredictors&);
+
+    // The common layouts get a kernel with the loops unrolled, the rest use the generic one.
+    static McuKernel SelectKernel(const ScanLayout& layout) {
+        const auto& sampling = layout.sampling;
+        if (sampling.size() == 1) {
+            return &McuRowDecoder::DecodeMcuFixed<1, 1, 1>;
+        }
+        if (sampling.size() != 3 || sampling[1] != std::pair{1, 1} ||
+            sampling[2] != std::pair{1, 1}) {
+            return &McuRowDecoder::DecodeMcuGeneric;
+        }
+        auto [hor, ver] = sampling[0];
+        if (hor == 1 && ver == 1) {
+            return &McuRowDecoder::DecodeMcuFixed<3, 1, 1>;  // 4:4:4
+        }
+        if (hor == 2 && ver == 1) {
+            return &McuRowDecoder::DecodeMcuFixed<3, 2, 1>;  // 4:2:2
+        }
+        if (hor == 2 && ver == 2) {
+            return &McuRowDecoder::DecodeMcuFixed<3, 2, 2>;  // 4:2:0
+        }
+        if (hor == 1 && ver == 2) {
+            return &McuRowDecoder::DecodeMcuFixed<3, 1, 2>;  // 4:4:0
+        }
+        return &McuRowDecoder::DecodeMcuGeneric;
+    }
+
+    // MCU of |kChannels| channels, the first one has kHor x kVer blocks and the rest one.
+    template <size_t kChannels, int kHor, int kVer>
+    void DecodeMcuFixed(BitReader& reader, size_t mcu_x, DcPredictors& prev_values) {
+        size_t blocks_x = layout_->mcus_x * kHor;
+        size_t first = mcu_x * kHor;
+        for (int v = 0; v < kVer; v++) {
+            for (int h = 0; h < kHor; h++) {
+                ReadBlock(reader, 0, first + v * blocks_x + h, prev_values);
+            }
+        }
+        for (size_t i = 1; i < kChannels; i++) {
+            ReadBlock(reader, i, mcu_x, prev_values);
+        }
+    }
+
+    void DecodeMcuGeneric(BitReader& reader, size_t mcu_x, DcPredictors& prev_values) {
+        for (size_t i = 0; i < channels_; i++) {
+            auto [cur_hor, cur_ver] = layout_->sampling[i];
+            for (int v = 0; v < cur_ver; v++) {
+                for (int h = 0; h < cur_hor; h++) {
+                    size_t block = (v * layout_->mcus_x + mcu_x) * cur_hor + h;
+                    ReadBlock(reader, i, block, prev_values);
+                }
+            }
+        }
+    }
+
+    // Decodes block |block| of the row of |channel|.
+    void ReadBlock(BitReader& reader, size_t channel, size_t block, DcPredictors& prev_values) {
+        const ChannelTables& tables = tables_[channel];
+        row_.last[channel][block] =
+            DecodeBlock<true>(reader, prev_values[channel], *tables.dc, *tables.ac, tables.dqt,
+                              row_.coefs[channel].data() + block * kFullBlock, stats_);
+    }
+
+    // Runs the IDCT on MCUs [begin, end) of the row.
+    void Transform(size_t begin, size_t end) {
+        StageTimer timer(stats_.idct_ns);
+        for (size_t i = 0; i < channels_; i++) {
+            auto [cur_hor, cur_ver] = layout_->sampling[i];
+            size_t blocks_x = layout_->mcus_x * cur_hor;
+            size_t count = (end - begin) * cur_hor;
+            int calls = cur_ver;
+            if (count == blocks_x) {
+                // the whole row is transformed at once
+                count *= cur_ver;
+                calls = 1;
+            }
+            for (int v = 0; v < calls; v++) {
+                size_t first = v * blocks_x + begin * cur_hor;
+                if (!reduced_[i]) {
+                    idct_.InverseMany(row_.coefs[i].data() + first * kFullBlock,
+                                      row_.last[i].data() + first, count,
+                                      block_outs_[i].data() + first, strides_[i]);
+                    continue;
+                }
+                for (size_t block = first; block < first + count; block++) {
+                    reduced_[i](row_.coefs[i].data() + block * kFullBlock, block_outs_[i][block],
+                             strides_[i]);
+                }
+            }
+        }
+    }
+
+    struct ChannelTables {
+        const QuantizationTable* dqt;
+        const HuffmanTree* dc;
+        const HuffmanTree* ac;
+    };
+
+    const ScanLayout* layout_ = nullptr;
+    size_t width_ = 0, height_ = 0;
+    size_t channels_ = 0;
+    std::vector<ChannelTables> tables_;
+    McuKernel decode_mcu_ = nullptr;
+    McuRowCoefficients row_;
+    std::vector<std::vector<Byte>> planes_;
+    std::vector<std::vector<Byte*>> block_outs_;
+    std::vector<size_t> strides_;
+    std::vector<std::vector<size_t>> column_maps_;
+    // output pixels per sample of the plane, 0 if it is not a whole number
+    std::vector<size_t> hor_factors_;
+    std::vector<std::vector<Byte>> upsampled_;
+    Idct idct_;
+    IdctBackend idct_backend_ = IdctBackend::kAuto;
+    size_t idct_batch_ = 0;  // 0 until idct_ is made for an image
+    // reduced transforms of scaled decoding per channel, nullptr if it is done by idct_
+    std::vector<void (*)(const int16_t*, Byte*, size_t)> reduced_;
+    DecodeStats stats_;
+    DecodeStats* stats_target_ = nullptr;
+};
+
+// Offsets of the RSTn markers in entropy-coded data.
+std::vector<size_t> FindRestartMarkers(std::span<const Byte> data) {
+    std::vector<size_t> res;
+    const Byte* begin = data.data();
+    const Byte* end = begin + data.size();
+    for (const Byte* cur = begin; cur < end;) {
+        cur = static_cast<const Byte*>(std::memchr(cur, 0xff, end - cur));
+        if (!cur || cur + 1 == end) {
             break;
         }
-        for (int i = 0; i < ((cur >> 4) & 0xf); i++) {
-            if (raw_data_ind >= kFullBlock) {
-                throw std::runtime_error("wrong AC coef in MCU");
+        if (0xd0 <= cur[1] && cur[1] <= 0xd7) {
+            res.push_back(cur - begin);
+        }
+        cur += cur[1] == 0xff ? 1 : 2;
+    }
+    return res;
+}
+
+// Restart intervals don't depend on each other: the scan is read into memory, split at
+// the RSTn markers and the intervals are decoded by a pool of threads. A thread takes a
+// run of consecutive intervals and writes the pixels itself.
+void ScanImageDataParallel(Image& res, BitReader& reader, MetaDataHandler& metainfo,
+                           const DecodeOptions& options, const ScanLayout& layout) {
+    std::span<const Byte> data = reader.ReadScanData();
+    std::vector<size_t> markers = FindRestartMarkers(data);
+    size_t interval = metainfo.restart_interval;
+    size_t total = layout.McuCount();
+    size_t segments = (total + interval - 1) / interval;
+    if (markers.size() + 1 < segments) {
+        throw std::runtime_error("not enough RST markers in the scan");
+    }
+    auto segment_data = [&](size_t segment) {
+        size_t begin = segment == 0 ? 0 : markers[segment - 1] + 2;
+        size_t end = segment < markers.size() ? markers[segment] : data.size();
+        return std::span<const Byte>(data.data() + begin, end - begin);
+    };
+
+    ThreadPool pool(options.threads);
+    // a few chunks per thread, so that a slow one doesn't hold up the rest
+    size_t chunks = std::min(segments, pool.Size() * 4);
+    pool.ParallelFor(chunks, [&](size_t chunk) {
+        McuRowDecoder decoder(layout, metainfo, options);
+        DcPredictors prev_values{};
+        size_t last_segment = segments * (chunk + 1) / chunks;
+        for (size_t segment = segments * chunk / chunks; segment < last_segment; segment++) {
+            size_t mcu = segment * interval;
+            size_t last = std::min(mcu + interval, total);
+            // intervals above or below the window are not read at all
+            if ((last - 1) / layout.mcus_x < layout.mcu_y_begin ||
+                mcu / layout.mcus_x >= layout.mcu_y_end) {
+                continue;
+            }
+            BitReader segment_reader(segment_data(segment));
+            segment_reader.SetIsSos(true);
+            std::fill(prev_values.begin(), prev_values.end(), 0);
+            while (mcu < last) {
+                size_t mcu_y = mcu / layout.mcus_x, begin = mcu % layout.mcus_x;
+                size_t end = std::min(layout.mcus_x, begin + (last - mcu));
+                {
+                    StageTimer timer(decoder.Stats().entropy_ns);
+                    for (size_t mcu_x = begin; mcu_x < end; mcu_x++, mcu++) {
+                        decoder.DecodeMcu(segment_reader, mcu_x, prev_values,
+                                          layout.InWindow(mcu_x, mcu_y));
+                    }
+                }
+                decoder.Output(res, mcu_y, begin, end, layout.window.y);
             }
-            raw_data[raw_data_ind++] = 0;
         }
-        if (raw_data_ind >= kFullBlock) {
-            throw std::runtime_error("wrong AC coef in MCU");
+    });
+}
+
+void ReadRestartMarker(BitReader& reader) {
+    reader.SkipCurrentByte();
+    reader.SetIsSos(false);
+    if (reader.ReadMarker() != RSTn) {
+        throw std::runtime_error("no RST marker after a restart interval");
+    }
+    reader.SetIsSos(true);
+}
+
+// Entropy-decodes the MCU row |mcu_y|, restart markers are read between the intervals.
+void DecodeMcuRow(BitReader& reader, McuRowDecoder& decoder, const ScanLayout& layout,
+                  size_t interval, size_t mcu_y, DcPredictors& prev_values) {
+    StageTimer timer(decoder.Stats().entropy_ns);
+    for (size_t mcu_x = 0; mcu_x < layout.mcus_x; mcu_x++) {
+        size_t mcu = mcu_y * layout.mcus_x + mcu_x;
+        if (interval != 0 && mcu != 0 && mcu % interval == 0) {
+            ReadRestartMarker(reader);
+            std::fill(prev_values.begin(), prev_values.end(), 0);
+        }
+        decoder.DecodeMcu(reader, mcu_x, prev_values, layout.InWindow(mcu_x, mcu_y));
+    }
+}
+
+// Bounded ring of decoded MCU rows between the entropy decoder and the pixel workers.
+// Rows are taken in order, but may be released in any order.
+class McuRowRing {
+public:
+    struct Slot {
+        McuRowCoefficients coefs;
+        size_t mcu_y = 0;
+        bool busy = false;
+    };
+
+    McuRowRing(size_t depth, const McuRowCoefficients& coefs)
+        : slots_(std::max<size_t>(depth, 1)) {
+        for (auto& slot : slots_) {
+            slot.coefs = coefs;
+        }
+    }
+
+    // Waits until the next slot is free, nullptr if the pipeline was aborted.
+    Slot* NextFree() {
+        std::unique_lock lock(mutex_);
+        Slot& slot = slots_[tail_ % slots_.size()];
+        free_.wait(lock, [&] { return !slot.busy || aborted_; });
+        return aborted_ ? nullptr : &slot;
+    }
+
+    void Publish() {
+        {
+            std::lock_guard lock(mutex_);
+            slots_[tail_++ % slots_.size()].busy = true;
+        }
+        ready_.notify_one();
+    }
+
+    // Waits for the next decoded row, nullptr once all of them are taken.
+    Slot* Take() {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return head_ < tail_ || closed_ || aborted_; });
+        if (aborted_ || head_ == tail_) {
+            return nullptr;
         }
-        raw_data[raw_data_ind++] = reader.ReadRawDataItem(cur & 0xf);
+        return &slots_[head_++ % slots_.size()];
     }
-    while (raw_data_ind < kFullBlock) {
-        raw_data[raw_data_ind++] = 0;
+
+    void Release(Slot* slot) {
+        {
+            std::lock_guard lock(mutex_);
+            slot->busy = false;
+        }
+        free_.notify_one();
     }
-    // CUM
-    raw_data[0] += last_dc;
-    last_dc = raw_data[0];
 
-    for (int i = 0; i < kFullBlock; i++) {
-        raw_data[i] *= table.items[i];
+    void Close() {
+        {
+            std::lock_guard lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
     }
-    calculator.LoadZigZagInput(raw_data.begin());
-    calculator.Inverse();
 
-    ImageBlock<Byte, kBlockSize> out;
-    for (int i = 0; i < kBlockSize; i++) {
-        for (int j = 0; j < kBlockSize; j++) {
-            out[i][j] = std::min(
-                255., std::max(0., 128 + round((*calculator.GetOutput())[i * kBlockSize + j])));
+    void Abort() {
+        {
+            std::lock_guard lock(mutex_);
+            aborted_ = true;
         }
+        ready_.notify_all();
+        free_.notify_all();
     }
-    return out;
+
+private:
+    std::vector<Slot> slots_;
+    std::mutex mutex_;
+    std::condition_variable free_, ready_;
+    size_t head_ = 0, tail_ = 0;
+    bool closed_ = false, aborted_ = false;
+};
+
+// One thread does the Huffman decoding and hands whole MCU rows of coefficients over
+// to the others, which run the IDCT and colour conversion on disjoint rows of |res|.
+void ScanImageDataPipelined(Image& res, BitReader& reader, MetaDataHandler& metainfo,
+                            const DecodeOptions& options, const ScanLayout& layout,
+                            ThreadPool& pool) {
+    McuRowDecoder producer(layout, metainfo, options);
+    McuRowRing ring(options.pipeline_depth, producer.Coefficients());
+    auto produce = [&] {
+        DcPredictors prev_values{};
+        reader.SetIsSos(true);
+        for (size_t mcu_y = 0; mcu_y < layout.mcu_y_end; mcu_y++) {
+            if (mcu_y < layout.mcu_y_begin) {
+                DecodeMcuRow(reader, producer, layout, metainfo.restart_interval, mcu_y,
+                             prev_values);
+                continue;
+            }
+            McuRowRing::Slot* slot = ring.NextFree();
+            if (!slot) {
+                return;
+            }
+            DecodeMcuRow(reader, producer, layout, metainfo.restart_interval, mcu_y,
+                         prev_values);
+            std::swap(producer.Coefficients(), slot->coefs);
+            slot->mcu_y = mcu_y;
+            ring.Publish();
+        }
+        if (layout.mcu_y_end == layout.mcus_y) {
+            reader.SkipCurrentByte();
+            reader.SetIsSos(false);
+        }
+    };
+    auto consume = [&] {
+        McuRowDecoder decoder(layout, metainfo, options);
+        while (McuRowRing::Slot* slot = ring.Take()) {
+            std::swap(decoder.Coefficients(), slot->coefs);
+            decoder.Output(res, slot->mcu_y, 0, layout.mcus_x, layout.window.y);
+            std::swap(decoder.Coefficients(), slot->coefs);
+            ring.Release(slot);
+        }
+    };
+
+    pool.ParallelFor(pool.Size(), [&](size_t i) {
+        try {
+            if (i == 0) {
+                produce();
+                ring.Close();
+            } else {
+                consume();
+            }
+        } catch (...) {
+            ring.Abort();
+            throw;
+        }
+    });
 }
 
-void ScanImageData(Image& res, BitReader& reader, MetaDataHandler& metainfo) {
-    size_t channels_count = metainfo.channels.size();
-    std::vector<int> prev_values(channels_count);
+// Decodes the scan one MCU row at a time into a buffer of a single band. Returns false
+// if the scan is left unfinished, because the rest of it is below the window.
+// |decoder| and |band| only lend their memory.
+bool ScanImageDataRows(BitReader& reader, MetaDataHandler& metainfo, const DecodeOptions& options,
+                       const ScanLayout& layout, McuRowDecoder& decoder, Image& band,
+                       const BandSink& sink) {
+    const Rect& window = layout.window;
+    decoder.Reset(layout, metainfo, options);
+    band.SetSize(window.width, layout.mcu_height, options.format);
+    DcPredictors prev_values{};
     reader.SetIsSos(true);
-    int table_no = 0;
-    int need_tables;
-    auto [hor, ver] = metainfo.MaxThinning();
-    int cnt_hor = ((res.Width() + kBlockSize - 1) / kBlockSize + ver - 1) / ver;
-    int cnt_ver = ((res.Height() + kBlockSize - 1) / kBlockSize + hor - 1) / hor;
-    need_tables = cnt_hor * cnt_ver;
-
-    size_t out_i = 0, out_j = 0;
-    std::vector<ImageBlock<int, 2 * kBlockSize>> ycbcr_data(channels_count);
-    MyDctCalculator calculator;
-
-    while (table_no++ < need_tables) {
-        for (size_t i = 0; i < channels_count; i++) {
-            int cur_hor = metainfo.channels[i].horizontal, cur_ver = metainfo.channels[i].vertical;
-            const QuantizationTable& dqt = metainfo.FindQTForChannel(i);
-            HuffmanTree& dc_tree = metainfo.FindHuffmanTreeForChannel(i, 0);
-            HuffmanTree& ac_tree = metainfo.FindHuffmanTreeForChannel(i, 1);
-            for (int h = 0; h < cur_hor; h++) {
-                for (int v = 0; v < cur_ver; ++v) {
-                    ImageBlock<Byte, kBlockSize> table =
-                        ReadNextMCU(reader, dqt, prev_values[i], dc_tree, ac_tree, calculator);
-                    for (int x = 0; x < kBlockSize; x++) {
-                        for (int y = 0; y < kBlockSize; y++) {
-                            ycbcr_data[i][x + h * kBlockSize][y + v * kBlockSize] = table[x][y];
-                        }
-                    }
+    for (size_t mcu_y = 0; mcu_y < layout.mcu_y_end; mcu_y++) {
+        DecodeMcuRow(reader, decoder, layout, metainfo.restart_interval, mcu_y, prev_values);
+        if (mcu_y < layout.mcu_y_begin) {
+            continue;
+        }
+        size_t first_row = std::max(mcu_y * layout.mcu_height, window.y);
+        size_t last_row = std::min((mcu_y + 1) * layout.mcu_height, window.y + window.height);
+        decoder.Output(band, mcu_y, 0, layout.mcus_x, first_row);
+        StageTimer timer(metainfo.stats.output_ns);
+        sink({window.width, window.height, first_row - window.y, last_row - first_row,
+              band.Format(), band.Stride(), band.Data().data()});
+    }
+    if (layout.mcu_y_end != layout.mcus_y) {
+        return false;
+    }
+
+    reader.SkipCurrentByte();
+    reader.SetIsSos(false);
+    return true;
+}
+
+// Same as ScanImageDataRows, but into the whole |res|. |decoder| is used only by the
+// calling thread.
+bool ScanImageData(Image& res, BitReader& reader, MetaDataHandler& metainfo,
+                   const DecodeOptions& options, const ScanLayout& layout,
+                   McuRowDecoder& decoder) {
+    {
+        StageTimer timer(metainfo.stats.output_ns);
+        res.SetSize(layout.window.width, layout.window.height, options.format);
+    }
+    size_t interval = metainfo.restart_interval;
+    if (options.threads != 1 && interval != 0 && layout.McuCount() > interval) {
+        ScanImageDataParallel(res, reader, metainfo, options, layout);
+        return true;
+    }
+    bool finished = layout.mcu_y_end == layout.mcus_y;
+    if (options.pipelined && options.threads != 1 && layout.mcus_y > 1) {
+        ThreadPool pool(options.threads);
+        if (pool.Size() > 1) {
+            ScanImageDataPipelined(res, reader, metainfo, options, layout, pool);
+            return finished;
+        }
+    }
+
+    decoder.Reset(layout, metainfo, options);
+    DcPredictors prev_values{};
+    reader.SetIsSos(true);
+    for (size_t mcu_y = 0; mcu_y < layout.mcu_y_end; mcu_y++) {
+        DecodeMcuRow(reader, decoder, layout, interval, mcu_y, prev_values);
+        decoder.Output(res, mcu_y, 0, layout.mcus_x, layout.window.y);
+    }
+    if (!finished) {
+        return false;
+    }
+
+    reader.SkipCurrentByte();
+    reader.SetIsSos(false);
+    return true;
+}
+
+// Components and the part of the coefficients carried by a scan (B.2.3 of T.81).
+struct ScanHeader {
+    std::vector<size_t> channels;  // indexes into MetaDataHandler::channels
+    int ss = 0, se = kFullBlock - 1;  // spectral selection, zigzag indexes
+    int ah = 0, al = 0;  // successive approximation: previous and current bit position
+};
+
+// First scan of DC coefficients: the difference from the previous block, shifted by al.
+void DecodeDcFirst(BitReader& reader, const HuffmanTree& huffman_dc, int al, int& last_dc,
+                   int16_t* block, DecodeStats& stats) {
+    if constexpr (kDecodeStatsEnabled) {
+        stats.huffman_symbols++;
+    }
+    last_dc = static_cast<short>(last_dc + reader.ReceiveExtend(reader.DecodeHuffman(huffman_dc)));
+    block[0] = last_dc * (1 << al);
+}
+
+// Further scans of DC coefficients add one bit each.
+void DecodeDcRefine(BitReader& reader, int al, int16_t* block) {
+    if (reader.ReadBits(1)) {
+        block[0] |= 1 << al;
+    }
+}
+
+// First scan of AC coefficients [ss, se]. A run of blocks with nothing in the band is
+// coded once as an EOB run, |eobrun| counts the blocks of it still left.
+void DecodeAcFirst(BitReader& reader, const HuffmanTree& huffman_ac, const ScanHeader& scan,
+                   int& eobrun, int16_t* block, DecodeStats& stats) {
+    if (eobrun > 0) {
+        eobrun--;
+        return;
+    }
+    int symbols = 0;
+    for (int k = scan.ss; k <= scan.se;) {
+        symbols++;
+        int run, value;
+        if (int fast = huffman_ac.LookupAc(reader.Peek(kHuffmanLookupBits)); fast != 0) {
+            reader.Consume(fast & 0xf);
+            run = fast >> 4 & 0xf;
+            value = fast >> 8;
+        } else {
+            int cur = reader.DecodeHuffman(huffman_ac);
+            run = cur >> 4;
+            if ((cur & 0xf) == 0) {
+                if (run == 15) {
+                    k += 16;
+                    continue;
                 }
+                // this block ends the band and so do the next eobrun ones
+                eobrun = (1 << run) - 1 + (run ? reader.ReadBits(run) : 0);
+                break;
             }
+            value = reader.ReceiveExtend(cur & 0xf);
+        }
+        k += run;
+        if (k > scan.se) {
+            throw std::runtime_error("wrong AC coef in MCU");
+        }
+        block[k++] = value * (1 << scan.al);
+    }
+    if constexpr (kDecodeStatsEnabled) {
+        stats.huffman_symbols += symbols;
+    }
+}
+
+// Further scans of AC coefficients (G.1.2.3 of T.81): every coefficient that is already
+// nonzero gets one more bit, the new ones are +-1 at al. Zero runs count only the
+// coefficients that are still zero.
+void DecodeAcRefine(BitReader& reader, const HuffmanTree& huffman_ac, const ScanHeader& scan,
+                    int& eobrun, int16_t* block, DecodeStats& stats) {
+    int bit = 1 << scan.al;
+    auto refine = [&](int16_t& coef) {
+        if (reader.ReadBits(1) && (coef & bit) == 0) {
+            coef += coef >= 0 ? bit : -bit;
         }
+    };
 
-        for (int i = 0; i < hor; i++) {
-            for (int j = 0; j < ver; j++) {
-                for (int y = 0; y < kBlockSize; y++) {
-                    for (int x = 0; x < kBlockSize; x++) {
-                        if (channels_count == 1) {
-                            int c = ycbcr_data[0][y][x];
-                            res.SetPixel(out_i + y + kBlockSize * i, out_j + x + kBlockSize * j,
-                                         {c, c, c});
-                            continue;
-                        }
-                        int real_x = x + kBlockSize * j, real_y = y + kBlockSize * i;
-                        int cury = ycbcr_data[0][real_y * metainfo.channels[0].horizontal / hor]
-                                             [real_x * metainfo.channels[0].vertical / ver];
-                        int curcb = ycbcr_data[1][real_y * metainfo.channels[1].horizontal / hor]
-                                              [real_x * metainfo.channels[1].vertical / ver];
-                        int curcr = ycbcr_data[2][real_y * metainfo.channels[2].horizontal / hor]
-                                              [real_x * metainfo.channels[2].vertical / ver];
-                        if (out_i + real_y < metainfo.height && out_j + real_x < metainfo.width) {
-                            res.SetPixel(out_i + real_y, out_j + real_x,
-                                         YCbCr(cury, curcb, curcr).ToRGB());
+    int k = scan.ss;
+    if (eobrun == 0) {
+        for (; k <= scan.se; k++) {
+            int cur = reader.DecodeHuffman(huffman_ac);
+            if constexpr (kDecodeStatsEnabled) {
+                stats.huffman_symbols++;
+            }
+            int run = cur >> 4;
+            int value = 0;
+            if ((cur & 0xf) != 0) {
+                if ((cur & 0xf) != 1) {
+                    throw std::runtime_error("wrong AC refinement in MCU");
+                }
+                value = reader.ReadBits(1) ? bit : -bit;
+            } else if (run != 15) {
+                eobrun = (1 << run) + (run ? reader.ReadBits(run) : 0);
+                break;
+            }
+            // skip |run| zero coefficients refining the nonzero ones on the way, the new
+            // one goes to the next zero
+            for (; k <= scan.se; k++) {
+                if (block[k] != 0) {
+                    refine(block[k]);
+                } else if (run-- == 0) {
+                    break;
+                }
+            }
+            if (value != 0) {
+                if (k > scan.se) {
+                    throw std::runtime_error("wrong AC coef in MCU");
+                }
+                block[k] = value;
+            }
+        }
+    }
+    if (eobrun > 0) {
+        // the rest of the band has no new coefficients
+        for (; k <= scan.se; k++) {
+            if (block[k] != 0) {
+                refine(block[k]);
+            }
+        }
+        eobrun--;
+    }
+}
+
+// Quantized coefficients of the whole image in zigzag order, progressive scans add to
+// them one after another. Every channel is stored as MCU rows of the shape
+// McuRowDecoder works with.
+class CoefficientBuffer {
+public:
+    // Zeroes the coefficients for an image of |layout|, the memory is kept between images.
+    void Reset(const ScanLayout& layout) {
+        layout_ = &layout;
+        blocks_.resize(std::max(blocks_.size(), layout.sampling.size()));
+        for (size_t i = 0; i < layout.sampling.size(); i++) {
+            auto [cur_hor, cur_ver] = layout.sampling[i];
+            blocks_[i].assign(layout.McuCount() * cur_hor * cur_ver * kFullBlock, 0);
+        }
+    }
+
+    // Blocks of MCU row |mcu_y| of |channel|.
+    const int16_t* Row(size_t channel, size_t mcu_y) const {
+        auto [cur_hor, cur_ver] = layout_->sampling[channel];
+        return blocks_[channel].data() + mcu_y * layout_->mcus_x * cur_hor * cur_ver * kFullBlock;
+    }
+
+    // Blocks with no AC coefficients, counted over the whole buffer.
+    size_t DcOnlyBlocks() const {
+        size_t res = 0;
+        for (const auto& channel : blocks_) {
+            for (size_t block = 0; block < channel.size(); block += kFullBlock) {
+                res += std::all_of(channel.begin() + block + 1,
+                                   channel.begin() + block + kFullBlock,
+                                   [](int16_t coef) { return coef == 0; });
+            }
+        }
+        return res;
+    }
+
+    // Moves the blocks of |channel| out, the buffer has to be Reset before it's used again.
+    std::vector<int16_t> Take(size_t channel) {
+        return std::move(blocks_[channel]);
+    }
+
+    size_t Blocks() const {
+        size_t res = 0;
+        for (const auto& channel : blocks_) {
+            res += channel.size() / kFullBlock;
+        }
+        return res;
+    }
+
+    void DecodeScan(BitReader& reader, MetaDataHandler& metainfo, const ScanHeader& scan) {
+        StageTimer timer(metainfo.stats.entropy_ns);
+        size_t start = reader.Position();
+        bool dc = scan.ss == 0;
+        // a baseline scan has all of the coefficients, it needs the AC trees too
+        bool baseline = !metainfo.progressive;
+        std::array<const HuffmanTree*, kMaxComponents> trees{}, ac_trees{};
+        for (size_t index = 0; index < scan.channels.size(); index++) {
+            // DC refinement is not Huffman-coded
+            if (!dc || scan.ah == 0) {
+                trees[index] =
+                    &metainfo.FindHuffmanTreeForChannel(scan.channels[index], dc ? 0 : 1);
+            }
+            if (baseline) {
+                ac_trees[index] = &metainfo.FindHuffmanTreeForChannel(scan.channels[index], 1);
+            }
+        }
+        DcPredictors prev_values{};
+        int eobrun = 0;
+        auto decode = [&](size_t index, size_t x, size_t y) {
+            size_t i = scan.channels[index];
+            size_t blocks_x = layout_->mcus_x * layout_->sampling[i].first;
+            int16_t* block = blocks_[i].data() + (y * blocks_x + x) * kFullBlock;
+            if (baseline) {
+                DecodeBlock<false>(reader, prev_values[i], *trees[index], *ac_trees[index],
+                                   nullptr, block, metainfo.stats);
+            } else if (dc && scan.ah == 0) {
+                DecodeDcFirst(reader, *trees[index], scan.al, prev_values[i], block,
+                              metainfo.stats);
+            } else if (dc) {
+                DecodeDcRefine(reader, scan.al, block);
+            } else if (scan.ah == 0) {
+                DecodeAcFirst(reader, *trees[index], scan, eobrun, block, metainfo.stats);
+            } else {
+                DecodeAcRefine(reader, *trees[index], scan, eobrun, block, metainfo.stats);
+            }
+        };
+        size_t interval = metainfo.restart_interval;
+        auto restart = [&](size_t unit) {
+            if (interval != 0 && unit != 0 && unit % interval == 0) {
+                ReadRestartMarker(reader);
+                std::fill(prev_values.begin(), prev_values.end(), 0);
+                eobrun = 0;
+            }
+        };
+
+        reader.SetIsSos(true);
+        if (scan.channels.size() == 1) {
+            // not interleaved: the blocks of the channel that cover the image, one by one
+            size_t i = scan.channels[0];
+            auto [cur_hor, cur_ver] = layout_->sampling[i];
+            size_t width = (metainfo.width * cur_hor + layout_->hor - 1) / layout_->hor;
+            size_t height = (metainfo.height * cur_ver + layout_->ver - 1) / layout_->ver;
+            size_t blocks_x = (width + kBlockSize - 1) / kBlockSize;
+            size_t blocks_y = (height + kBlockSize - 1) / kBlockSize;
+            for (size_t y = 0; y < blocks_y; y++) {
+                for (size_t x = 0; x < blocks_x; x++) {
+                    restart(y * blocks_x + x);
+                    decode(0, x, y);
+                }
+            }
+        } else {
+            for (size_t mcu = 0; mcu < layout_->McuCount(); mcu++) {
+                restart(mcu);
+                size_t mcu_x = mcu % layout_->mcus_x, mcu_y = mcu / layout_->mcus_x;
+                for (size_t index = 0; index < scan.channels.size(); index++) {
+                    auto [cur_hor, cur_ver] = layout_->sampling[scan.channels[index]];
+                    for (int v = 0; v < cur_ver; v++) {
+                        for (int h = 0; h < cur_hor; h++) {
+                            decode(index, mcu_x * cur_hor + h, mcu_y * cur_ver + v);
                         }
                     }
                 }
             }
         }
-        out_j += ver * kBlockSize;
-        if (out_j >= metainfo.width) {
-            out_i += hor * kBlockSize;
-            out_j = 0;
+        reader.SkipCurrentByte();
+        reader.SetIsSos(false);
+        if constexpr (kDecodeStatsEnabled) {
+            metainfo.stats.entropy_coded_bytes += reader.Position() - start;
         }
     }
 
-    reader.SkipCurrentByte();
+private:
+    const ScanLayout* layout_ = nullptr;
+    std::vector<std::vector<int16_t>> blocks_;
+};
+
+// Memory of a decode that Decoder keeps for the next image.
+struct DecodeScratch {
+    BitReader reader;
+    MetaDataHandler metainfo;
+    ScanHeader scan;
+    ScanLayout layout;
+    McuRowDecoder decoder;  // of the calling thread
+    CoefficientBuffer coefficients;  // of progressive images and DecodeCoefficients
+    Image band;  // of DecodeRows
+    Image image;
+};
+
+// Makes the pixels of the window from the coefficients of |scratch|, into |res| or band by
+// band into |sink|.
+void OutputCoefficients(DecodeScratch& scratch, const DecodeOptions& options, Image& res,
+                        const BandSink* sink) {
+    MetaDataHandler& metainfo = scratch.metainfo;
+    const ScanLayout& layout = scratch.layout;
+    const Rect& window = layout.window;
+    auto load = [&](McuRowDecoder& decoder, size_t mcu_y) {
+        StageTimer timer(decoder.Stats().idct_ns);
+        for (size_t i = 0; i < metainfo.channels.size(); i++) {
+            decoder.LoadCoefficients(i, scratch.coefficients.Row(i, mcu_y));
+        }
+    };
+    if (sink) {
+        McuRowDecoder& decoder = scratch.decoder;
+        decoder.Reset(layout, metainfo, options);
+        Image& band = scratch.band;
+        band.SetSize(window.width, layout.mcu_height, options.format);
+        for (size_t mcu_y = layout.mcu_y_begin; mcu_y < layout.mcu_y_end; mcu_y++) {
+            size_t first_row = std::max(mcu_y * layout.mcu_height, window.y);
+            size_t last_row = std::min((mcu_y + 1) * layout.mcu_height, window.y + window.height);
+            load(decoder, mcu_y);
+            decoder.Output(band, mcu_y, 0, layout.mcus_x, first_row);
+            StageTimer timer(metainfo.stats.output_ns);
+            (*sink)({window.width, window.height, first_row - window.y, last_row - first_row,
+                     band.Format(), band.Stride(), band.Data().data()});
+        }
+        return;
+    }
+
+    // MCU rows don't depend on each other any more
+    {
+        StageTimer timer(metainfo.stats.output_ns);
+        res.SetSize(window.width, window.height, options.format);
+    }
+    if (options.threads == 1) {
+        scratch.decoder.Reset(layout, metainfo, options);
+        for (size_t mcu_y = layout.mcu_y_begin; mcu_y < layout.mcu_y_end; mcu_y++) {
+            load(scratch.decoder, mcu_y);
+            scratch.decoder.Output(res, mcu_y, 0, layout.mcus_x, window.y);
+        }
+        return;
+    }
+    ThreadPool pool(options.threads);
+    size_t rows = layout.mcu_y_end - layout.mcu_y_begin;
+    size_t chunks = std::min(rows, pool.Size() * 4);
+    pool.ParallelFor(chunks, [&](size_t chunk) {
+        McuRowDecoder decoder(layout, metainfo, options);
+        size_t last = layout.mcu_y_begin + rows * (chunk + 1) / chunks;
+        for (size_t mcu_y = layout.mcu_y_begin + rows * chunk / chunks; mcu_y < last; mcu_y++) {
+            load(decoder, mcu_y);
+            decoder.Output(res, mcu_y, 0, layout.mcus_x, window.y);
+        }
+    });
 }
 
-Image Decode(std::istream& input) {
-    input >> std::noskipws;
+// Adds the bytes read since |start| to the ones of segment |marker|.
+void CountSegment(MetaDataHandler& metainfo, Marker marker, const BitReader& reader,
+                  size_t start) {
+    if constexpr (kDecodeStatsEnabled) {
+        metainfo.segment_bytes[marker] += reader.Position() - start;
+    }
+}
 
-    BitReader reader(input);
+// Reads the next segment into |metainfo| and returns its marker. Of SOS only the marker
+// is read, the header is left for ReadScanHeader.
+Marker ReadSegment(BitReader& reader, MetaDataHandler& metainfo) {
+    size_t start = reader.Position();
+    Marker cur = reader.ReadMarker();
+    if (cur == EOI || cur == SOS) {
+        // the header of SOS is added by ReadScanHeader
+        CountSegment(metainfo, cur, reader, start);
+        return cur;
+    }
+    if (cur == COM) {
+        DByte len = reader.ReadSectionLength();
+        metainfo.comment.resize(len - 2);
+        reader.ReadNBytes({reinterpret_cast<Byte*>(metainfo.comment.data()), len - 2u});
+    } else if (cur == APPn) {
+        DByte len = reader.ReadSectionLength();
+        reader.Skip(len - 2);
+    } else if (cur == DQT) {
+        DByte len = reader.ReadSectionLength();
+        ReadQuantizationTables(reader, len - 2, metainfo);
+        if (metainfo.dqt_tables.size() > kMaxQuantizationTables) {
+            throw std::runtime_error("too much huffman trees");
+        }
+    } else if (cur == SOF0 || cur == SOF2) {
+        if (!metainfo.channels.empty()) {
+            throw std::runtime_error("multiple sof");
+        }
+        metainfo.progressive = cur == SOF2;
+        [[maybe_unused]] DByte len = reader.ReadSectionLength();
+        (void)reader.ReadByte();
+        metainfo.height = reader.ReadDByte();
+        metainfo.width = reader.ReadDByte();
+        int channels_cnt = reader.ReadByte();
+        if (!(channels_cnt == 1 || channels_cnt == 3)) {
+            throw std::runtime_error("number of channels is not equal to 1 or 3");
+        }
+
+        for (int i = 0; i < channels_cnt; i++) {
+            std::array<Byte, 3> tmp;
+            reader.ReadNBytes(tmp);
+            metainfo.channels.push_back({tmp[0], tmp[1] >> 4 & 0xf, tmp[1] & 0xf, tmp[2], -1, -1});
+            const Channel& channel = metainfo.channels.back();
+            if (channel.horizontal < 1 || channel.horizontal > kMaxSamplingFactor ||
+                channel.vertical < 1 || channel.vertical > kMaxSamplingFactor) {
+                throw std::runtime_error("wrong sampling factors");
+            }
+        }
+    } else if (cur == DRI) {
+        [[maybe_unused]] DByte len = reader.ReadSectionLength();
+        metainfo.restart_interval = reader.ReadDByte();
+    } else if (cur == DHT) {
+        DByte len = reader.ReadSectionLength();
+        ReadHuffmanTables(reader, len - 2, metainfo);
+        if (metainfo.huffs.size() > kMaxHuffmanTrees) {
+            throw std::runtime_error("too much huffman trees");
+        }
+    }
+    CountSegment(metainfo, cur, reader, start);
+    return cur;
+}
+
+// Reads segments into |metainfo| up to the next scan. Returns true once SOS is read and
+// false at EOI.
+bool ReadSegments(BitReader& reader, MetaDataHandler& metainfo) {
+    StageTimer timer(metainfo.stats.parse_ns);
+    while (true) {
+        Marker cur = ReadSegment(reader, metainfo);
+        if (cur == EOI || cur == SOS) {
+            return cur == SOS;
+        }
+    }
+}
+
+// Reads the segments before the first scan. Returns true once SOS is read and false at EOI.
+bool ReadHeaders(BitReader& reader, MetaDataHandler& metainfo) {
+    size_t start = reader.Position();
     if (reader.ReadMarker() != SOI) {
         throw std::runtime_error("no SOI at the beginning of the file");
     }
-    Image res;
+    CountSegment(metainfo, SOI, reader, start);
+    return ReadSegments(reader, metainfo);
+}
+
+// Throws BitReader::OutOfData unless all of the next segment has arrived, so that it is
+// never read half way. The reader is left where it was.
+void RequireSegment(BitReader& reader) {
+    BitReader::State start = reader.Save();
+    Marker marker = reader.ReadMarker();
+    if (marker != SOI && marker != EOI && marker != RSTn) {
+        DByte len = reader.ReadSectionLength();
+        if (len < 2) {
+            throw std::runtime_error("wrong segment length");
+        }
+        reader.Skip(len - 2);
+    }
+    reader.Restore(start);
+}
+
+// Reads the header of a scan into |scan|, which keeps its memory.
+void ReadScanHeader(BitReader& reader, MetaDataHandler& metainfo, ScanHeader& scan) {
+    StageTimer timer(metainfo.stats.parse_ns);
+    size_t start = reader.Position();
+    [[maybe_unused]] DByte len = reader.ReadSectionLength() - 2;
+    Byte channels_count = reader.ReadByte();
+    len--;
+    if (channels_count == 0 || channels_count > kMaxComponents) {
+        throw std::runtime_error("wrong SOS section");
+    }
+    scan.channels.clear();
+    int blocks = 0;
+    for (int ch = 0; ch < channels_count; ch++) {
+        Byte id = reader.ReadByte();
+        Byte huffman_ids = reader.ReadByte();
+        len -= 2;
+        scan.channels.push_back(metainfo.SetHuffmanACDCIndex(id, huffman_ids));
+        const Channel& channel = metainfo.channels[scan.channels.back()];
+        blocks += channel.horizontal * channel.vertical;
+    }
+    if (channels_count > 1 && blocks > kMaxBlocksInMcu) {
+        throw std::runtime_error("too many blocks in MCU");
+    }
+    std::array<Byte, 3> prog;
+    reader.ReadNBytes(prog);
+    scan.ss = prog[0];
+    scan.se = prog[1];
+    scan.ah = prog[2] >> 4;
+    scan.al = prog[2] & 0xf;
+    CountSegment(metainfo, SOS, reader, start);
+    if (!metainfo.progressive) {
+        if (scan.ss != 0 || scan.se != 63 || prog[2] != 0) {
+            throw std::runtime_error("wrong SOS section");
+        }
+        return;
+    }
+    // a scan has either the DC or a band of AC coefficients of a single channel
+    if (scan.ss > scan.se || scan.se > 63 || (scan.ss == 0 && scan.se != 0) ||
+        (scan.ss != 0 && scan.channels.size() != 1) || scan.al > 13 ||
+        (scan.ah != 0 && scan.ah != scan.al + 1)) {
+        throw std::runtime_error("wrong SOS section");
+    }
+}
+
+// Progressive images are decoded scan by scan into the coefficients of the whole image,
+// the pixels are made once all of them are read.
+void DecodeProgressive(DecodeScratch& scratch, const DecodeOptions& options,
+                       const BandSink* sink) {
+    BitReader& reader = scratch.reader;
+    MetaDataHandler& metainfo = scratch.metainfo;
+    CoefficientBuffer& buffer = scratch.coefficients;
+    buffer.Reset(scratch.layout);
+    buffer.DecodeScan(reader, metainfo, scratch.scan);
+    while (ReadSegments(reader, metainfo)) {
+        if (options.on_scan) {
+            Image preview;
+            OutputCoefficients(scratch, options, preview, nullptr);
+            StageTimer timer(metainfo.stats.output_ns);
+            options.on_scan(preview);
+        }
+        ReadScanHeader(reader, metainfo, scratch.scan);
+        buffer.DecodeScan(reader, metainfo, scratch.scan);
+    }
+    if constexpr (kDecodeStatsEnabled) {
+        metainfo.stats.mcus += scratch.layout.McuCount();
+        metainfo.stats.blocks += buffer.Blocks();
+        metainfo.stats.dc_only_blocks += buffer.DcOnlyBlocks();
+    }
+    OutputCoefficients(scratch, options, scratch.image, sink);
+}
+
+void DecodeScans(DecodeScratch& scratch, const DecodeOptions& options, const BandSink* sink) {
+    BitReader& reader = scratch.reader;
+    MetaDataHandler& metainfo = scratch.metainfo;
+    if (!ReadHeaders(reader, metainfo)) {
+        return;
+    }
+    ReadScanHeader(reader, metainfo, scratch.scan);
+    scratch.layout.Reset(metainfo, options);
+    if (metainfo.progressive) {
+        DecodeProgressive(scratch, options, sink);
+        return;
+    }
+
+    size_t start = reader.Position();
+    bool finished = sink ? ScanImageDataRows(reader, metainfo, options, scratch.layout,
+                                             scratch.decoder, scratch.band, *sink)
+                         : ScanImageData(scratch.image, reader, metainfo, options, scratch.layout,
+                                         scratch.decoder);
+    if constexpr (kDecodeStatsEnabled) {
+        metainfo.stats.entropy_coded_bytes += reader.Position() - start;
+    }
+    // a scan stopped below the window of interest isn't read to the end
+    if (finished) {
+        size_t eoi = reader.Position();
+        if (reader.ReadMarker() != EOI) {
+            throw std::runtime_error("something after eoi");
+        }
+        CountSegment(metainfo, EOI, reader, eoi);
+    }
+}
+
+void CheckOptions(const DecodeOptions& options) {
+    if (options.scale != 1 && options.scale != 2 && options.scale != 4 && options.scale != 8) {
+        throw std::invalid_argument("scale must be 1, 2, 4 or 8");
+    }
+}
+
+// Adds the counters of a finished decode to options.stats and the comment to the image.
+void FinishDecode(DecodeScratch& scratch, const DecodeOptions& options) {
+    scratch.decoder.FlushStats();
+    AddStats(options.stats, scratch.metainfo.stats, scratch.metainfo.segment_bytes);
+    scratch.image.SetComment(scratch.metainfo.comment);
+}
+
+// Decodes the input of scratch.reader. Without a sink the image goes to scratch.image,
+// with one it gets the pixels band by band and scratch.image only gets the comment.
+void DecodeImpl(DecodeScratch& scratch, const DecodeOptions& options,
+                const BandSink* sink = nullptr) {
+    CheckOptions(options);
+    scratch.metainfo.Clear();
+    scratch.image.SetSize(0, 0, options.format);
+    try {
+        DecodeScans(scratch, options, sink);
+    } catch (...) {
+        // the row decoder is kept, but options.stats may not outlive the call
+        scratch.decoder.FlushStats();
+        throw;
+    }
+    FinishDecode(scratch, options);
+}
+
+// Reads every scan into scratch.coefficients and copies the blocks out in natural order.
+CoefficientImage DecodeCoefficientsImpl(DecodeScratch& scratch) {
+    BitReader& reader = scratch.reader;
+    MetaDataHandler& metainfo = scratch.metainfo;
+    CoefficientBuffer& buffer = scratch.coefficients;
+    CoefficientImage res;
+    if (!ReadHeaders(reader, metainfo)) {
+        return res;
+    }
+    ReadScanHeader(reader, metainfo, scratch.scan);
+    const ScanLayout& layout = scratch.layout;
+    scratch.layout.Reset(metainfo, DecodeOptions{});
+    buffer.Reset(layout);
+    buffer.DecodeScan(reader, metainfo, scratch.scan);
+    while (ReadSegments(reader, metainfo)) {
+        ReadScanHeader(reader, metainfo, scratch.scan);
+        buffer.DecodeScan(reader, metainfo, scratch.scan);
+    }
+
+    res.width = metainfo.width;
+    res.height = metainfo.height;
+    res.progressive = metainfo.progressive;
+    res.comment = metainfo.comment;
+    for (size_t i = 0; i < metainfo.channels.size(); i++) {
+        const Channel& channel = metainfo.channels[i];
+        auto [cur_hor, cur_ver] = layout.sampling[i];
+        CoefficientPlane plane{channel.id, channel.horizontal, channel.vertical,
+                               metainfo.FindQTForChannel(i).id, channel.huffman_dc,
+                               channel.huffman_ac};
+        plane.blocks_x = layout.mcus_x * cur_hor;
+        plane.blocks_y = layout.mcus_y * cur_ver;
+        // the blocks are reordered in place, copying them would take longer than the scans
+        plane.coefs = buffer.Take(i);
+        for (size_t block = 0; block < plane.blocks_x * plane.blocks_y; block++) {
+            std::span<int16_t, kFullBlock> out(plane.coefs.data() + block * kFullBlock,
+                                               kFullBlock);
+            std::array<int16_t, kFullBlock> zigzag;
+            std::copy(out.begin(), out.end(), zigzag.begin());
+            utils::Vector2ZigZagFlatten(zigzag.begin(), out);
+        }
+        res.components.push_back(std::move(plane));
+    }
+    for (const QuantizationTable& table : metainfo.dqt_tables) {
+        QuantizationTableValues& values = res.quantization_tables.emplace_back();
+        values.id = table.id;
+        utils::Vector2ZigZagFlatten(table.items.begin(), values.values);
+    }
+    for (const HuffmanTable& table : metainfo.huffs) {
+        size_t total = std::accumulate(table.counts.begin(), table.counts.end(), size_t{0});
+        res.huffman_tables.push_back({table.cl, table.id, table.counts,
+                                      {table.values.begin(), table.values.begin() + total}});
+    }
+    return res;
+}
+
+// Quality that libjpeg's jpeg_set_quality would need to produce tables like these: the
+// tables are compared with the ones from Annex K by the sum of their entries.
+int EstimateQuality(const MetaDataHandler& metainfo) {
+    if (metainfo.dqt_tables.empty()) {
+        return 0;
+    }
+    auto table_sum = [](const auto& table) {
+        return std::accumulate(std::begin(table), std::end(table), 0.0);
+    };
+    // the first channel is luminance, the others share the chrominance table
+    double actual = 0, standard = 0;
+    for (size_t i = 0; i < std::min<size_t>(metainfo.channels.size(), 2); i++) {
+        actual += table_sum(metainfo.FindQTForChannel(i).items);
+        standard += table_sum(i == 0 ? kStdLuminanceQuant : kStdChrominanceQuant);
+    }
+    if (metainfo.channels.empty()) {
+        actual = table_sum(metainfo.dqt_tables[0].items);
+        standard = table_sum(kStdLuminanceQuant);
+    }
+    double scale = actual * 100 / standard;
+    double quality = scale <= 100 ? (200 - scale) / 2 : 5000 / scale;
+    return std::clamp(static_cast<int>(std::lround(quality)), 1, 100);
+}
 
+ProbeInfo ProbeImpl(BitReader& reader) {
     MetaDataHandler metainfo;
+    ReadHeaders(reader, metainfo);
 
-    bool have_sof0 = false;
-    while (true) {
-        Marker cur = reader.ReadMarker();
-        if (cur == EOI) {
-            break;
-        } else if (cur == COM) {
-            DByte len = reader.ReadSectionLength();
-            std::vector<Byte> comment = reader.ReadNBytes(len - 2);
-            res.SetComment(std::string{comment.begin(), comment.end()});
-        } else if (cur == APPn) {
-            DByte len = reader.ReadSectionLength();
-            std::vector<Byte> appn = reader.ReadNBytes(len - 2);
-        } else if (cur == DQT) {
-            DByte len = reader.ReadSectionLength();
-            for (auto& table : ReadQuantizationTables(reader, len - 2)) {
-                metainfo.dqt_tables.emplace_back(std::move(table));
-                metainfo.dqt_tables.shrink_to_fit();
-            }
-            if (metainfo.dqt_tables.size() > kMaxQuantizationTables) {
-                throw std::runtime_error("too much huffman trees");
-            }
-        } else if (cur == SOF0) {
-            if (have_sof0) {
-                throw std::runtime_error("multiple sof0");
-            }
-            have_sof0 = true;
-            [[maybe_unused]] DByte len = reader.ReadSectionLength();
-            (void)reader.ReadByte();
-            metainfo.height = reader.ReadDByte();
-            metainfo.width = reader.ReadDByte();
-            int channels_cnt = reader.ReadByte();
-            if (!(channels_cnt == 1 || channels_cnt == 3)) {
-                throw std::runtime_error("number of channels is not equal to 1 or 3");
-            }
-            res.SetSize(metainfo.width, metainfo.height);
-
-            for (int i = 0; i < channels_cnt; i++) {
-                std::vector<Byte> tmp = reader.ReadNBytes(3);
-                metainfo.channels.push_back(
-                    {tmp[0], tmp[1] & 0xf, tmp[1] >> 4 & 0xf, tmp[2], -1, -1});
-            }
-        } else if (cur == DHT) {
-            DByte len = reader.ReadSectionLength();
-            for (auto& tree : ReadHuffmanTables(reader, len - 2)) {
-                metainfo.huffs.emplace_back(std::move(tree));
-            }
-            metainfo.huffs.shrink_to_fit();
-            if (metainfo.huffs.size() > kMaxHuffmanTrees) {
-                throw std::runtime_error("too much huffman trees");
-            }
-        } else if (cur == SOS) {
-            [[maybe_unused]] DByte len = reader.ReadSectionLength() - 2;
-            Byte channels_count = reader.ReadByte();
-            len--;
-            for (int ch = 0; ch < channels_count; ch++) {
-                Byte id = reader.ReadByte();
-                Byte huffman_ids = reader.ReadByte();
-                len -= 2;
-                metainfo.SetHuffmanACDCIndex(id, huffman_ids);
+    ProbeInfo res;
+    res.width = metainfo.width;
+    res.height = metainfo.height;
+    for (const Channel& channel : metainfo.channels) {
+        res.components.push_back(
+            {channel.id, channel.horizontal, channel.vertical, channel.dqt_id});
+    }
+    res.comment = std::move(metainfo.comment);
+    for (const QuantizationTable& table : metainfo.dqt_tables) {
+        res.quantization_tables.push_back(table.id);
+    }
+    for (const HuffmanTable& table : metainfo.huffs) {
+        (table.cl == 0 ? res.dc_tables : res.ac_tables).push_back(table.id);
+    }
+    res.restart_interval = metainfo.restart_interval;
+    res.progressive = metainfo.progressive;
+    res.quality = EstimateQuality(metainfo);
+    return res;
+}
+
+std::span<const Byte> AsBytes(std::span<const std::byte> data) {
+    return {reinterpret_cast<const Byte*>(data.data()), data.size()};
+}
+
+Image Decode(std::istream& input, const DecodeOptions& options) {
+    DecodeScratch scratch;
+    scratch.reader.Reset(input);
+    DecodeImpl(scratch, options);
+    return std::move(scratch.image);
+}
+
+Image Decode(std::istream& input, const Rect& roi, DecodeOptions options) {
+    options.roi = roi;
+    return Decode(input, options);
+}
+
+Image Decode(std::span<const std::byte> data, const DecodeOptions& options) {
+    DecodeScratch scratch;
+    scratch.reader.Reset(AsBytes(data));
+    DecodeImpl(scratch, options);
+    return std::move(scratch.image);
+}
+
+Image DecodeFile(const std::string& path, const DecodeOptions& options) {
+    MappedFile file(path);
+    return Decode(file.Data(), options);
+}
+
+void DecodeRows(std::istream& input, const BandSink& sink, const DecodeOptions& options) {
+    DecodeScratch scratch;
+    scratch.reader.Reset(input);
+    DecodeImpl(scratch, options, &sink);
+}
+
+void DecodeRows(std::span<const std::byte> data, const BandSink& sink,
+                const DecodeOptions& options) {
+    DecodeScratch scratch;
+    scratch.reader.Reset(AsBytes(data));
+    DecodeImpl(scratch, options, &sink);
+}
+
+Decoder::Decoder(const DecodeOptions& options)
+    : options_(options), scratch_(std::make_unique<DecodeScratch>()) {
+}
+
+Decoder::Decoder(Decoder&&) noexcept = default;
+
+Decoder& Decoder::operator=(Decoder&&) noexcept = default;
+
+Decoder::~Decoder() = default;
+
+const Image& Decoder::Decode(std::istream& input) {
+    scratch_->reader.Reset(input);
+    DecodeImpl(*scratch_, options_);
+    return scratch_->image;
+}
+
+const Image& Decoder::Decode(std::span<const std::byte> data) {
+    scratch_->reader.Reset(AsBytes(data));
+    DecodeImpl(*scratch_, options_);
+    return scratch_->image;
+}
+
+const Image& Decoder::DecodeFile(const std::string& path) {
+    MappedFile file(path);
+    return Decode(file.Data());
+}
+
+void Decoder::DecodeRows(std::istream& input, const BandSink& sink) {
+    scratch_->reader.Reset(input);
+    DecodeImpl(*scratch_, options_, &sink);
+}
+
+void Decoder::DecodeRows(std::span<const std::byte> data, const BandSink& sink) {
+    scratch_->reader.Reset(AsBytes(data));
+    DecodeImpl(*scratch_, options_, &sink);
+}
+
+Image Decoder::TakeImage() {
+    return std::move(scratch_->image);
+}
+
+// The decoder goes in steps, each of them either done as a whole or, when the input runs
+// out, undone by bringing the reader back to where the step began. The exception is the
+// entropy-coded data of a baseline scan, which is resumed from the MCU it stopped in.
+class IncrementalDecoder::Impl {
+public:
+    explicit Impl(const DecodeOptions& options) : options_(options) {
+        CheckOptions(options);
+        Reset();
+    }
+
+    void Reset() {
+        scratch_.metainfo.Clear();
+        scratch_.image.SetSize(0, 0, options_.format);
+        scratch_.reader.ResetAppendable();
+        stage_ = Stage::kStart;
+        mcu_x_ = mcu_y_ = 0;
+        prev_values_ = {};
+        rows_ready_ = 0;
+    }
+
+    FeedStatus Feed(std::span<const Byte> data) {
+        // whatever comes after EOI is ignored
+        if (stage_ != Stage::kDone && !data.empty()) {
+            scratch_.reader.Append(data);
+        }
+        return Advance();
+    }
+
+    FeedStatus Close() {
+        scratch_.reader.Close();
+        FeedStatus status;
+        while ((status = Advance()) != FeedStatus::kDone) {
+            if (status == FeedStatus::kNeedMoreData) {
+                throw std::runtime_error("the input ended too early");
             }
-            {
-                // just a check for progressive
-                auto prog = reader.ReadNBytes(3);
-                if (prog[0] != 0 || prog[1] != 63 || prog[2] != 0) {
-                    throw std::runtime_error("wrong SOS section");
+        }
+        return status;
+    }
+
+    const Image& GetImage() const {
+        return scratch_.image;
+    }
+
+    Image TakeImage() {
+        return std::move(scratch_.image);
+    }
+
+    size_t RowsReady() const {
+        return rows_ready_;
+    }
+
+private:
+    enum class Stage { kStart, kHeaders, kScan, kTrailer, kProgressiveScan, kSegments, kDone };
+
+    DecodeOptions options_;
+    DecodeScratch scratch_;
+    Stage stage_ = Stage::kStart;
+    size_t mcu_x_ = 0, mcu_y_ = 0;  // the next MCU of a baseline scan
+    DcPredictors prev_values_{};
+    // where the reader is brought back to if the input runs out
+    BitReader::State checkpoint_{};
+    size_t scan_start_ = 0;
+    size_t rows_ready_ = 0;
+
+    // Goes on until the input runs out, the header is read or the image is done.
+    FeedStatus Advance() {
+        BitReader& reader = scratch_.reader;
+        size_t rows = rows_ready_;
+        try {
+            while (stage_ != Stage::kDone) {
+                checkpoint_ = reader.Save();
+                try {
+                    if (Step()) {
+                        return FeedStatus::kHeaderReady;
+                    }
+                } catch (const BitReader::OutOfData&) {
+                    reader.Restore(checkpoint_);
+                    break;
+                }
+            }
+        } catch (...) {
+            scratch_.decoder.FlushStats();
+            throw;
+        }
+        if (stage_ == Stage::kDone) {
+            return FeedStatus::kDone;
+        }
+        return rows_ready_ != rows ? FeedStatus::kRowsReady : FeedStatus::kNeedMoreData;
+    }
+
+    // Returns true once the header is read.
+    bool Step() {
+        BitReader& reader = scratch_.reader;
+        MetaDataHandler& metainfo = scratch_.metainfo;
+        switch (stage_) {
+            case Stage::kStart: {
+                size_t start = reader.Position();
+                if (reader.ReadMarker() != SOI) {
+                    throw std::runtime_error("no SOI at the beginning of the file");
+                }
+                CountSegment(metainfo, SOI, reader, start);
+                stage_ = Stage::kHeaders;
+                return false;
+            }
+            case Stage::kHeaders:
+                return ReadHeaderSegment();
+            case Stage::kScan:
+                DecodeMcus();
+                return false;
+            case Stage::kTrailer: {
+                size_t eoi = reader.Position();
+                if (reader.ReadMarker() != EOI) {
+                    throw std::runtime_error("something after eoi");
                 }
+                CountSegment(metainfo, EOI, reader, eoi);
+                Finish();
+                return false;
             }
+            case Stage::kProgressiveScan: {
+                // the scan is decoded only once all of it is here
+                BitReader::State start = reader.Save();
+                reader.ReadScanData();
+                reader.Restore(start);
+                scratch_.coefficients.DecodeScan(reader, metainfo, scratch_.scan);
+                stage_ = Stage::kSegments;
+                return false;
+            }
+            case Stage::kSegments:
+                ReadProgressiveSegment();
+                return false;
+            case Stage::kDone:
+                return false;
+        }
+        return false;
+    }
 
-            ScanImageData(res, reader, metainfo);
+    // Reads a segment before the first scan, returns true if it was SOS.
+    bool ReadHeaderSegment() {
+        BitReader& reader = scratch_.reader;
+        MetaDataHandler& metainfo = scratch_.metainfo;
+        StageTimer timer(metainfo.stats.parse_ns);
+        RequireSegment(reader);
+        Marker marker = ReadSegment(reader, metainfo);
+        if (marker == EOI) {
+            Finish();
+        }
+        if (marker != SOS) {
+            return false;
+        }
+        ReadScanHeader(reader, metainfo, scratch_.scan);
+        ScanLayout& layout = scratch_.layout;
+        layout.Reset(metainfo, options_);
+        scratch_.image.SetSize(layout.window.width, layout.window.height, options_.format);
+        if (metainfo.progressive) {
+            scratch_.coefficients.Reset(layout);
+            stage_ = Stage::kProgressiveScan;
+            return true;
+        }
+        scratch_.decoder.Reset(layout, metainfo, options_);
+        scan_start_ = reader.Position();
+        reader.SetIsSos(true);
+        stage_ = Stage::kScan;
+        return true;
+    }
 
-            if (reader.ReadMarker() != EOI) {
-                throw std::runtime_error("something after eoi");
+    // Decodes the MCUs that have arrived and makes the pixels of every finished row.
+    void DecodeMcus() {
+        BitReader& reader = scratch_.reader;
+        McuRowDecoder& decoder = scratch_.decoder;
+        const ScanLayout& layout = scratch_.layout;
+        const Rect& window = layout.window;
+        size_t interval = scratch_.metainfo.restart_interval;
+        while (mcu_y_ < layout.mcu_y_end) {
+            {
+                StageTimer timer(decoder.Stats().entropy_ns);
+                // the predictors are kept only with the MCUs that are read to the end
+                DcPredictors prev_values = prev_values_;
+                while (mcu_x_ < layout.mcus_x) {
+                    size_t mcu = mcu_y_ * layout.mcus_x + mcu_x_;
+                    if (interval != 0 && mcu != 0 && mcu % interval == 0) {
+                        ReadRestartMarker(reader);
+                        std::fill(prev_values.begin(), prev_values.end(), 0);
+                    }
+                    decoder.DecodeMcu(reader, mcu_x_, prev_values,
+                                      layout.InWindow(mcu_x_, mcu_y_));
+                    mcu_x_++;
+                    prev_values_ = prev_values;
+                    checkpoint_ = reader.Save();
+                }
             }
+            decoder.Output(scratch_.image, mcu_y_, 0, layout.mcus_x, window.y);
+            size_t bottom = std::min((mcu_y_ + 1) * layout.mcu_height, window.y + window.height);
+            rows_ready_ = std::max(bottom, window.y) - window.y;
+            mcu_x_ = 0;
+            mcu_y_++;
+        }
+        if constexpr (kDecodeStatsEnabled) {
+            scratch_.metainfo.stats.entropy_coded_bytes += reader.Position() - scan_start_;
+        }
+        // a scan stopped below the window of interest isn't read to the end
+        if (layout.mcu_y_end != layout.mcus_y) {
+            Finish();
+            return;
         }
+        reader.SkipCurrentByte();
+        reader.SetIsSos(false);
+        stage_ = Stage::kTrailer;
     }
 
-    return res;
+    // Reads a segment after a scan of a progressive image.
+    void ReadProgressiveSegment() {
+        BitReader& reader = scratch_.reader;
+        MetaDataHandler& metainfo = scratch_.metainfo;
+        RequireSegment(reader);
+        Marker marker;
+        {
+            StageTimer timer(metainfo.stats.parse_ns);
+            marker = ReadSegment(reader, metainfo);
+        }
+        if (marker == SOS) {
+            if (options_.on_scan) {
+                Image preview;
+                OutputCoefficients(scratch_, options_, preview, nullptr);
+                StageTimer timer(metainfo.stats.output_ns);
+                options_.on_scan(preview);
+            }
+            ReadScanHeader(reader, metainfo, scratch_.scan);
+            stage_ = Stage::kProgressiveScan;
+            return;
+        }
+        if (marker != EOI) {
+            return;
+        }
+        if constexpr (kDecodeStatsEnabled) {
+            metainfo.stats.mcus += scratch_.layout.McuCount();
+            metainfo.stats.blocks += scratch_.coefficients.Blocks();
+            metainfo.stats.dc_only_blocks += scratch_.coefficients.DcOnlyBlocks();
+        }
+        OutputCoefficients(scratch_, options_, scratch_.image, nullptr);
+        Finish();
+    }
+
+    void Finish() {
+        stage_ = Stage::kDone;
+        rows_ready_ = scratch_.image.Height();
+        FinishDecode(scratch_, options_);
+    }
+};
+
+IncrementalDecoder::IncrementalDecoder(const DecodeOptions& options)
+    : impl_(std::make_unique<Impl>(options)) {
+}
+
+IncrementalDecoder::IncrementalDecoder(IncrementalDecoder&&) noexcept = default;
+
+IncrementalDecoder& IncrementalDecoder::operator=(IncrementalDecoder&&) noexcept = default;
+
+IncrementalDecoder::~IncrementalDecoder() = default;
+
+FeedStatus IncrementalDecoder::Feed(std::span<const std::byte> data) {
+    return impl_->Feed(AsBytes(data));
+}
+
+FeedStatus IncrementalDecoder::Close() {
+    return impl_->Close();
+}
+
+void IncrementalDecoder::Reset() {
+    impl_->Reset();
+}
+
+const Image& IncrementalDecoder::GetImage() const {
+    return impl_->GetImage();
+}
+
+size_t IncrementalDecoder::RowsReady() const {
+    return impl_->RowsReady();
+}
+
+Image IncrementalDecoder::TakeImage() {
+    return impl_->TakeImage();
+}
+
+ProbeInfo Probe(std::istream& input) {
+    BitReader reader(input);
+    return ProbeImpl(reader);
+}
+
+ProbeInfo Probe(std::span<const std::byte> data) {
+    BitReader reader(AsBytes(data));
+    return ProbeImpl(reader);
+}
+
+CoefficientImage DecodeCoefficients(std::istream& input) {
+    DecodeScratch scratch;
+    scratch.reader.Reset(input);
+    return DecodeCoefficientsImpl(scratch);
+}
+
+CoefficientImage DecodeCoefficients(std::span<const std::byte> data) {
+    DecodeScratch scratch;
+    scratch.reader.Reset(AsBytes(data));
+    return DecodeCoefficientsImpl(scratch);
 }
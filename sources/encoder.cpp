@@ -0,0 +1,410 @@
+#include "encoder.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+
+#include "bit_writer.h"
+#include "constants.h"
+#include "huffman.h"
+#include "types.h"
+
+namespace {
+
+// Codes of a table by symbol, symbols without a code have length 0.
+struct HuffmanCode {
+    std::array<uint16_t, 256> codes{};
+    std::array<uint8_t, 256> lengths{};
+};
+
+// Codes are assigned as in C.2 and C.3 of T.81.
+HuffmanCode MakeCode(const HuffmanTableValues& table) {
+    HuffmanCode res;
+    uint32_t code = 0;
+    size_t ind = 0;
+    for (int len = 1; len <= kHuffmanMaxCodeLen; len++) {
+        for (int i = 0; i < table.counts[len - 1]; i++, code++, ind++) {
+            if (ind >= table.values.size() || code >= (1u << len)) {
+                throw std::invalid_argument("wrong Huffman table");
+            }
+            res.codes[table.values[ind]] = code;
+            res.lengths[table.values[ind]] = len;
+        }
+        code <<= 1;
+    }
+    return res;
+}
+
+// Table for symbols of frequencies |freq| as in K.2 of T.81: a reserved symbol makes sure
+// no code is all ones, and codes longer than 16 bits are moved up as K.3 does.
+HuffmanTableValues MakeOptimizedTable(int table_class, int id,
+                                      const std::array<uint64_t, 256>& freq) {
+    constexpr int kSymbols = 257;
+    std::array<uint64_t, kSymbols> weight{};
+    std::copy(freq.begin(), freq.end(), weight.begin());
+    weight[256] = 1;
+    std::array<int, kSymbols> code_size{};
+    std::array<int, kSymbols> others;
+    others.fill(-1);
+    while (true) {
+        // the two least frequent trees, the one with the larger symbol first on ties
+        int v1 = -1, v2 = -1;
+        for (int i = 0; i < kSymbols; i++) {
+            if (weight[i] != 0 && (v1 < 0 || weight[i] <= weight[v1])) {
+                v1 = i;
+            }
+        }
+        for (int i = 0; i < kSymbols; i++) {
+            if (weight[i] != 0 && i != v1 && (v2 < 0 || weight[i] <= weight[v2])) {
+                v2 = i;
+            }
+        }
+        if (v2 < 0) {
+            break;
+        }
+        weight[v1] += weight[v2];
+        weight[v2] = 0;
+        for (code_size[v1]++; others[v1] >= 0; code_size[v1]++) {
+            v1 = others[v1];
+        }
+        others[v1] = v2;
+        for (code_size[v2]++; others[v2] >= 0; code_size[v2]++) {
+            v2 = others[v2];
+        }
+    }
+
+    std::array<int, 2 * kSymbols> bits{};
+    for (int i = 0; i < kSymbols; i++) {
+        bits[code_size[i]] += code_size[i] != 0;
+    }
+    for (int i = bits.size() - 1; i > kHuffmanMaxCodeLen; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    // the reserved symbol has one of the longest codes
+    int longest = kHuffmanMaxCodeLen;
+    while (bits[longest] == 0) {
+        longest--;
+    }
+    bits[longest]--;
+
+    HuffmanTableValues res{table_class, id, {}, {}};
+    for (int len = 1; len <= kHuffmanMaxCodeLen; len++) {
+        res.counts[len - 1] = bits[len];
+    }
+    // symbols sorted by their lengths before the adjustment, which keeps the order
+    for (int len = 1; len < static_cast<int>(bits.size()); len++) {
+        for (int i = 0; i < 256; i++) {
+            if (code_size[i] == len) {
+                res.values.push_back(i);
+            }
+        }
+    }
+    return res;
+}
+
+// Size category of F.1.2.1 of T.81: the number of bits of |value|.
+int SizeOf(int value) {
+    return std::bit_width(static_cast<unsigned>(std::abs(value)));
+}
+
+// Calls emit(ac, symbol, bits, size) for every symbol of a block in natural order, F.1.2.
+template <class Emit>
+void EmitBlock(const int16_t* block, int& last_dc, Emit&& emit) {
+    int diff = block[0] - last_dc;
+    last_dc = block[0];
+    int size = SizeOf(diff);
+    if (size > 11) {
+        throw std::invalid_argument("DC difference doesn't fit in a baseline image");
+    }
+    emit(false, size, diff < 0 ? diff - 1 : diff, size);
+    int run = 0;
+    for (int k = 1; k < kFullBlock; k++) {
+        int value = block[kNaturalOrder[k]];
+        if (value == 0) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16) {
+            emit(true, 0xf0, 0, 0);
+        }
+        size = SizeOf(value);
+        if (size > 10) {
+            throw std::invalid_argument("AC coefficient doesn't fit in a baseline image");
+        }
+        emit(true, run << 4 | size, value < 0 ? value - 1 : value, size);
+        run = 0;
+    }
+    if (run > 0) {
+        emit(true, 0x00, 0, 0);
+    }
+}
+
+std::pair<int, int> MaxSampling(const CoefficientImage& image) {
+    int hor = 1, ver = 1;
+    for (const CoefficientPlane& plane : image.components) {
+        hor = std::max(hor, plane.horizontal);
+        ver = std::max(ver, plane.vertical);
+    }
+    return {hor, ver};
+}
+
+void CheckImage(const CoefficientImage& image) {
+    if (image.width == 0 || image.height == 0 || image.width > 0xffff ||
+        image.height > 0xffff) {
+        throw std::invalid_argument("wrong image size");
+    }
+    if (image.components.empty() || image.components.size() > kMaxComponents) {
+        throw std::invalid_argument("wrong number of components");
+    }
+    bool single = image.components.size() == 1;
+    auto [hor, ver] = MaxSampling(image);
+    int blocks = 0;
+    for (const CoefficientPlane& plane : image.components) {
+        if (plane.horizontal < 1 || plane.horizontal > kMaxSamplingFactor ||
+            plane.vertical < 1 || plane.vertical > kMaxSamplingFactor) {
+            throw std::invalid_argument("wrong sampling factors");
+        }
+        blocks += plane.horizontal * plane.vertical;
+        // blocks of whole MCUs, or just the ones covering the image if it's gray
+        size_t mcu_width = single ? kBlockSize : hor * kBlockSize;
+        size_t mcu_height = single ? kBlockSize : ver * kBlockSize;
+        size_t mcus_x = (image.width + mcu_width - 1) / mcu_width;
+        size_t mcus_y = (image.height + mcu_height - 1) / mcu_height;
+        size_t need_x = single ? mcus_x : mcus_x * plane.horizontal;
+        size_t need_y = single ? mcus_y : mcus_y * plane.vertical;
+        if (plane.blocks_x < need_x || plane.blocks_y < need_y ||
+            plane.coefs.size() != plane.blocks_x * plane.blocks_y * kFullBlock) {
+            throw std::invalid_argument("not enough blocks for the image");
+        }
+        auto table = std::find_if(
+            image.quantization_tables.begin(), image.quantization_tables.end(),
+            [&](const auto& cur) { return cur.id == plane.quantization_table; });
+        if (table == image.quantization_tables.end() || table->id < 0 || table->id > 3) {
+            throw std::invalid_argument("no quantization table for a component");
+        }
+    }
+    if (!single && blocks > kMaxBlocksInMcu) {
+        throw std::invalid_argument("too many blocks in MCU");
+    }
+}
+
+// Calls callback(component, block) for the blocks in the order of the scan.
+template <class Callback>
+void ForEachBlock(const CoefficientImage& image, Callback&& callback) {
+    if (image.components.size() == 1) {
+        const CoefficientPlane& plane = image.components[0];
+        size_t blocks_x = (image.width + kBlockSize - 1) / kBlockSize;
+        size_t blocks_y = (image.height + kBlockSize - 1) / kBlockSize;
+        for (size_t y = 0; y < blocks_y; y++) {
+            for (size_t x = 0; x < blocks_x; x++) {
+                callback(0, plane.Block(x, y).data());
+            }
+        }
+        return;
+    }
+    auto [hor, ver] = MaxSampling(image);
+    size_t mcus_x = (image.width + hor * kBlockSize - 1) / (hor * kBlockSize);
+    size_t mcus_y = (image.height + ver * kBlockSize - 1) / (ver * kBlockSize);
+    for (size_t mcu_y = 0; mcu_y < mcus_y; mcu_y++) {
+        for (size_t mcu_x = 0; mcu_x < mcus_x; mcu_x++) {
+            for (size_t i = 0; i < image.components.size(); i++) {
+                const CoefficientPlane& plane = image.components[i];
+                for (int v = 0; v < plane.vertical; v++) {
+                    for (int h = 0; h < plane.horizontal; h++) {
+                        callback(i, plane.Block(mcu_x * plane.horizontal + h,
+                                                mcu_y * plane.vertical + v)
+                                        .data());
+                    }
+                }
+            }
+        }
+    }
+}
+
+void WriteDByte(std::vector<Byte>& out, int value) {
+    out.push_back(value >> 8);
+    out.push_back(value & 0xff);
+}
+
+// Writes the marker 0xFF |code| and the length of a segment with |size| bytes after it.
+void WriteSegmentHeader(std::vector<Byte>& out, Byte code, size_t size) {
+    out.push_back(0xff);
+    out.push_back(code);
+    WriteDByte(out, size + 2);
+}
+
+// DC and AC tables of every component, the ids are the ones written to SOS.
+struct TableChoice {
+    std::vector<HuffmanTableValues> tables;
+    std::vector<std::pair<int, int>> ids;
+};
+
+// Tables of the image used by the components, nullopt if some of them are missing.
+std::optional<TableChoice> SourceTables(const CoefficientImage& image) {
+    TableChoice res;
+    for (const CoefficientPlane& plane : image.components) {
+        for (int table_class = 0; table_class < 2; table_class++) {
+            int id = table_class == 0 ? plane.dc_table : plane.ac_table;
+            auto it = std::find_if(
+                image.huffman_tables.begin(), image.huffman_tables.end(),
+                [&](const auto& cur) { return cur.table_class == table_class && cur.id == id; });
+            if (it == image.huffman_tables.end() || id < 0 || id > 3) {
+                return std::nullopt;
+            }
+            if (std::none_of(res.tables.begin(), res.tables.end(), [&](const auto& cur) {
+                    return cur.table_class == table_class && cur.id == id;
+                })) {
+                res.tables.push_back(*it);
+            }
+        }
+        res.ids.emplace_back(plane.dc_table, plane.ac_table);
+    }
+    return res;
+}
+
+TableChoice OptimizedTables(const CoefficientImage& image) {
+    // [first component or the rest][DC or AC]
+    std::array<std::array<std::array<uint64_t, 256>, 2>, 2> freq{};
+    std::vector<int> last_dc(image.components.size());
+    ForEachBlock(image, [&](size_t component, const int16_t* block) {
+        auto& group = freq[component != 0];
+        EmitBlock(block, last_dc[component],
+                  [&](bool ac, int symbol, int, int) { group[ac][symbol]++; });
+    });
+    TableChoice res;
+    size_t groups = image.components.size() == 1 ? 1 : 2;
+    for (size_t group = 0; group < groups; group++) {
+        res.tables.push_back(MakeOptimizedTable(0, group, freq[group][0]));
+        res.tables.push_back(MakeOptimizedTable(1, group, freq[group][1]));
+    }
+    for (size_t i = 0; i < image.components.size(); i++) {
+        res.ids.emplace_back(i != 0, i != 0);
+    }
+    return res;
+}
+
+// Writes the whole image with the tables of |choice|. Returns false if a symbol has no code.
+bool WriteImage(const CoefficientImage& image, const TableChoice& choice,
+                std::vector<Byte>& out) {
+    out.clear();
+    out.insert(out.end(), {0xff, 0xd8});
+    WriteSegmentHeader(out, 0xe0, 14);
+    out.insert(out.end(), {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+    if (!image.comment.empty()) {
+        size_t size = std::min<size_t>(image.comment.size(), 0xffff - 2);
+        WriteSegmentHeader(out, 0xfe, size);
+        out.insert(out.end(), image.comment.begin(), image.comment.begin() + size);
+    }
+
+    bool wide = false;
+    std::vector<int> written;
+    for (const CoefficientPlane& plane : image.components) {
+        if (std::find(written.begin(), written.end(), plane.quantization_table) !=
+            written.end()) {
+            continue;
+        }
+        written.push_back(plane.quantization_table);
+        const auto& table = *std::find_if(
+            image.quantization_tables.begin(), image.quantization_tables.end(),
+            [&](const auto& cur) { return cur.id == plane.quantization_table; });
+        bool precision = std::any_of(table.values.begin(), table.values.end(),
+                                     [](uint16_t value) { return value > 0xff; });
+        wide |= precision;
+        WriteSegmentHeader(out, 0xdb, 1 + kFullBlock * (precision ? 2 : 1));
+        out.push_back(precision << 4 | table.id);
+        for (int k = 0; k < kFullBlock; k++) {
+            if (precision) {
+                WriteDByte(out, table.values[kNaturalOrder[k]]);
+            } else {
+                out.push_back(table.values[kNaturalOrder[k]]);
+            }
+        }
+    }
+
+    bool single = image.components.size() == 1;
+    WriteSegmentHeader(out, wide ? 0xc1 : 0xc0, 6 + 3 * image.components.size());
+    out.push_back(8);
+    WriteDByte(out, image.height);
+    WriteDByte(out, image.width);
+    out.push_back(image.components.size());
+    for (const CoefficientPlane& plane : image.components) {
+        out.push_back(plane.id);
+        out.push_back(single ? 0x11 : plane.horizontal << 4 | plane.vertical);
+        out.push_back(plane.quantization_table);
+    }
+
+    for (const HuffmanTableValues& table : choice.tables) {
+        WriteSegmentHeader(out, 0xc4, 1 + table.counts.size() + table.values.size());
+        out.push_back(table.table_class << 4 | table.id);
+        out.insert(out.end(), table.counts.begin(), table.counts.end());
+        out.insert(out.end(), table.values.begin(), table.values.end());
+    }
+
+    WriteSegmentHeader(out, 0xda, 4 + 2 * image.components.size());
+    out.push_back(image.components.size());
+    for (size_t i = 0; i < image.components.size(); i++) {
+        out.push_back(image.components[i].id);
+        out.push_back(choice.ids[i].first << 4 | choice.ids[i].second);
+    }
+    out.insert(out.end(), {0, 63, 0});
+
+    // codes of every component, DC and AC
+    std::vector<HuffmanCode> codes;
+    for (const HuffmanTableValues& table : choice.tables) {
+        codes.push_back(MakeCode(table));
+    }
+    auto find_code = [&](int table_class, int id) {
+        for (size_t i = 0; i < choice.tables.size(); i++) {
+            if (choice.tables[i].table_class == table_class && choice.tables[i].id == id) {
+                return &codes[i];
+            }
+        }
+        throw std::logic_error("no Huffman table for a component");
+    };
+    std::vector<std::array<const HuffmanCode*, 2>> component_codes;
+    for (auto [dc, ac] : choice.ids) {
+        component_codes.push_back({find_code(0, dc), find_code(1, ac)});
+    }
+
+    bool complete = true;
+    BitWriter writer(out);
+    std::vector<int> last_dc(image.components.size());
+    ForEachBlock(image, [&](size_t component, const int16_t* block) {
+        const auto& cur = component_codes[component];
+        EmitBlock(block, last_dc[component], [&](bool ac, int symbol, int bits, int size) {
+            const HuffmanCode& code = *cur[ac];
+            complete &= code.lengths[symbol] != 0;
+            writer.Write(code.codes[symbol], code.lengths[symbol]);
+            writer.Write(bits, size);
+        });
+    });
+    writer.Finish();
+    out.insert(out.end(), {0xff, 0xd9});
+    return complete;
+}
+
+}  // namespace
+
+std::vector<uint8_t> EncodeCoefficients(const CoefficientImage& image, HuffmanTables tables) {
+    CheckImage(image);
+    std::vector<Byte> out;
+    if (tables == HuffmanTables::kSource) {
+        if (auto source = SourceTables(image); source && WriteImage(image, *source, out)) {
+            return out;
+        }
+    }
+    WriteImage(image, OptimizedTables(image), out);
+    return out;
+}
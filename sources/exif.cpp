@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "constants.h"
+#include "exif.h"
+
+namespace {
+// tags of IFD0, of the Exif IFD and of IFD1 (the thumbnail)
+constexpr uint16_t kOrientation = 0x0112;
+constexpr uint16_t kDateTime = 0x0132;
+constexpr uint16_t kExifIfd = 0x8769;
+constexpr uint16_t kDateTimeOriginal = 0x9003;
+constexpr uint16_t kPixelXDimension = 0xa002;
+constexpr uint16_t kPixelYDimension = 0xa003;
+constexpr uint16_t kThumbnailOffset = 0x0201;
+constexpr uint16_t kThumbnailLength = 0x0202;
+
+constexpr uint16_t kAscii = 2, kShort = 3, kLong = 4;
+
+constexpr size_t kEntrySize = 12;
+
+struct IfdEntry {
+    uint16_t tag, type;
+    uint32_t count;
+    size_t value;  // offset of the value field, it holds the value or points to it
+};
+
+// TIFF data in either byte order, offsets count from its header as in the format.
+class Tiff {
+public:
+    // Returns false if |data| doesn't start with a TIFF header.
+    bool Open(std::span<const std::byte> data) {
+        data_ = data;
+        if (!Has(0, 8)) {
+            return false;
+        }
+        auto order = static_cast<char>(data_[0]);
+        if (order != static_cast<char>(data_[1]) || (order != 'I' && order != 'M')) {
+            return false;
+        }
+        little_endian_ = order == 'I';
+        return U16(2) == 42;
+    }
+
+    std::span<const std::byte> Data() const {
+        return data_;
+    }
+
+    bool Has(size_t offset, size_t size) const {
+        return offset <= data_.size() && size <= data_.size() - offset;
+    }
+
+    uint32_t FirstIfd() const {
+        return U32(4);
+    }
+
+    // Calls |f| for every entry of the IFD at |offset| that fits into the data. Returns the
+    // offset of the next IFD, 0 if there is none.
+    template <class F>
+    uint32_t ForEachEntry(uint32_t offset, F&& f) const {
+        if (offset == 0 || !Has(offset, 2)) {
+            return 0;
+        }
+        size_t count = U16(offset);
+        size_t entries = offset + 2;
+        for (size_t i = 0; i < count && Has(entries + i * kEntrySize, kEntrySize); i++) {
+            size_t entry = entries + i * kEntrySize;
+            f(IfdEntry{U16(entry), U16(entry + 2), U32(entry + 4), entry + 8});
+        }
+        size_t next = entries + count * kEntrySize;
+        return Has(next, 4) ? U32(next) : 0;
+    }
+
+    // SHORT or LONG value of |entry|.
+    std::optional<uint32_t> Number(const IfdEntry& entry) const {
+        if (entry.count != 1) {
+            return std::nullopt;
+        }
+        if (entry.type == kShort) {
+            return U16(entry.value);
+        }
+        if (entry.type == kLong) {
+            return U32(entry.value);
+        }
+        return std::nullopt;
+    }
+
+    // ASCII value of |entry| without the terminating zeros.
+    std::string String(const IfdEntry& entry) const {
+        if (entry.type != kAscii) {
+            return {};
+        }
+        size_t offset = entry.count <= 4 ? entry.value : U32(entry.value);
+        if (!Has(offset, entry.count)) {
+            return {};
+        }
+        std::string res(reinterpret_cast<const char*>(data_.data()) + offset, entry.count);
+        res.resize(std::strlen(res.c_str()));
+        return res;
+    }
+
+private:
+    std::span<const std::byte> data_;
+    bool little_endian_ = false;
+
+    uint16_t U16(size_t offset) const {
+        auto b0 = static_cast<uint16_t>(data_[offset]);
+        auto b1 = static_cast<uint16_t>(data_[offset + 1]);
+        return little_endian_ ? b0 | b1 << 8 : b0 << 8 | b1;
+    }
+
+    uint32_t U32(size_t offset) const {
+        uint32_t lo = U16(offset), hi = U16(offset + 2);
+        return little_endian_ ? lo | hi << 16 : lo << 16 | hi;
+    }
+};
+}  // namespace
+
+std::optional<ExifInfo> ReadExif(std::span<const std::byte> jpeg) {
+    auto byte = [&](size_t pos) { return static_cast<int>(jpeg[pos]); };
+    if (jpeg.size() < 2 || (byte(0) << 8 | byte(1)) != 0xffd8) {
+        throw std::runtime_error("no SOI at the beginning of the file");
+    }
+    for (size_t pos = 2; pos + 4 <= jpeg.size();) {
+        if (byte(pos) != 0xff) {
+            return std::nullopt;
+        }
+        int code = byte(pos) << 8 | byte(pos + 1);
+        if (code == 0xffff) {
+            pos++;  // fill byte
+            continue;
+        }
+        auto marker = kCode2Marker.find(code);
+        if (marker != kCode2Marker.end() && (marker->second == SOS || marker->second == EOI)) {
+            return std::nullopt;
+        }
+        size_t len = byte(pos + 2) << 8 | byte(pos + 3);
+        if (len < 2) {
+            return std::nullopt;
+        }
+        // other APP1 segments hold XMP and the like
+        if (code == kAPPnMin + 1) {
+            auto payload = jpeg.subspan(pos + 4, std::min(len - 2, jpeg.size() - pos - 4));
+            if (std::optional<ExifInfo> res = ParseExif(payload)) {
+                return res;
+            }
+        }
+        pos += 2 + len;
+    }
+    return std::nullopt;
+}
+
+std::optional<ExifInfo> ParseExif(std::span<const std::byte> app1) {
+    constexpr char kHeader[] = "Exif\0";  // the literal adds the second zero
+    if (app1.size() < sizeof(kHeader) || std::memcmp(app1.data(), kHeader, sizeof(kHeader))) {
+        return std::nullopt;
+    }
+    Tiff tiff;
+    if (!tiff.Open(app1.subspan(sizeof(kHeader)))) {
+        return std::nullopt;
+    }
+
+    ExifInfo res;
+    std::string date_time;
+    uint32_t exif_ifd = 0;
+    uint32_t ifd1 = tiff.ForEachEntry(tiff.FirstIfd(), [&](const IfdEntry& entry) {
+        if (entry.tag == kOrientation) {
+            uint32_t orientation = tiff.Number(entry).value_or(1);
+            if (orientation >= 1 && orientation <= 8) {
+                res.orientation = orientation;
+            }
+        } else if (entry.tag == kDateTime) {
+            date_time = tiff.String(entry);
+        } else if (entry.tag == kExifIfd) {
+            exif_ifd = tiff.Number(entry).value_or(0);
+        }
+    });
+    tiff.ForEachEntry(exif_ifd, [&](const IfdEntry& entry) {
+        if (entry.tag == kDateTimeOriginal) {
+            res.capture_time = tiff.String(entry);
+        } else if (entry.tag == kPixelXDimension) {
+            res.width = tiff.Number(entry).value_or(0);
+        } else if (entry.tag == kPixelYDimension) {
+            res.height = tiff.Number(entry).value_or(0);
+        }
+    });
+    if (res.capture_time.empty()) {
+        res.capture_time = std::move(date_time);
+    }
+
+    // IFD1 describes the thumbnail, it is JPEG if it has these two
+    std::optional<uint32_t> offset, length;
+    tiff.ForEachEntry(ifd1, [&](const IfdEntry& entry) {
+        if (entry.tag == kThumbnailOffset) {
+            offset = tiff.Number(entry);
+        } else if (entry.tag == kThumbnailLength) {
+            length = tiff.Number(entry);
+        }
+    });
+    if (offset && length && *length >= 2 && tiff.Has(*offset, *length)) {
+        std::span<const std::byte> thumbnail = tiff.Data().subspan(*offset, *length);
+        if (thumbnail[0] == std::byte{0xff} && thumbnail[1] == std::byte{0xd8}) {
+            res.thumbnail = thumbnail;
+        }
+    }
+    return res;
+}
+
+TransformOp UprightTransform(int orientation) {
+    switch (orientation) {
+        case 2:
+            return TransformOp::kFlipHorizontal;
+        case 3:
+            return TransformOp::kRotate180;
+        case 4:
+            return TransformOp::kFlipVertical;
+        case 5:
+            return TransformOp::kTranspose;
+        case 6:
+            return TransformOp::kRotate90;
+        case 7:
+            return TransformOp::kTransverse;
+        case 8:
+            return TransformOp::kRotate270;
+        default:
+            return TransformOp::kNone;
+    }
+}
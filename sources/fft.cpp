@@ -2,6 +2,48 @@
 
 #include <fftw3.h>
 #include <math.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+namespace {
+// the FFTW planner is not thread safe, fftw_execute_r2r is
+std::mutex planner_mutex;
+
+void Rescale(double *input, size_t width) {
+    constexpr double kMagicMultiplier = 1. / 16.;
+
+    for (size_t i = 0, j = 0; i < width; i++, j += width) {
+        input[i] *= M_SQRT2;
+        input[j] *= M_SQRT2;
+    }
+    for (size_t i = 0; i < width * width; i++) {
+        input[i] *= kMagicMultiplier;
+    }
+}
+
+fftw_plan GetBatchPlan(size_t width, size_t count) {
+    static std::map<std::pair<size_t, size_t>, fftw_plan> plans;
+
+    std::lock_guard lock(planner_mutex);
+    fftw_plan &plan = plans[{width, count}];
+    if (!plan) {
+        // FFTW_MEASURE overwrites the arrays, so plan on scratch ones. Plans are only
+        // executed through fftw_execute_r2r, buffers from fftw_alloc_real have the
+        // same alignment.
+        int size = width * width;
+        int n[] = {static_cast<int>(width), static_cast<int>(width)};
+        fftw_r2r_kind kinds[] = {FFTW_REDFT01, FFTW_REDFT01};
+        double *input = fftw_alloc_real(size * count);
+        double *output = fftw_alloc_real(size * count);
+        plan = fftw_plan_many_r2r(2, n, count, input, nullptr, 1, size, output, nullptr, 1, size,
+                                  kinds, FFTW_MEASURE);
+        fftw_free(input);
+        fftw_free(output);
+    }
+    return plan;
+}
+}  // namespace
 
 class DctCalculator::Impl {
 public:
@@ -24,24 +66,75 @@ DctCalculator::DctCalculator(size_t width, std::vector<double> *input, std::vect
     impl_->input = input, impl_->output = output;
     impl_->width = width;
 
+    std::lock_guard lock(planner_mutex);
     impl_->plan =
         fftw_plan_r2r_2d(impl_->width, impl_->width, impl_->input->data(), impl_->output->data(),
                          FFTW_REDFT01, FFTW_REDFT01, FFTW_ESTIMATE);
 }
 
 void DctCalculator::Inverse() {
-    constexpr double kMagicMultiplier = 1. / 16.;
-
-    for (size_t i = 0, j = 0; i < impl_->width; i++, j += impl_->width) {
-        impl_->input->data()[i] *= M_SQRT2;
-        impl_->input->data()[j] *= M_SQRT2;
-    }
-    for (auto &i : *impl_->input) {
-        i *= kMagicMultiplier;
-    }
+    Rescale(impl_->input->data(), impl_->width);
     fftw_execute(impl_->plan);
 }
 
 DctCalculator::~DctCalculator() {
+    std::lock_guard lock(planner_mutex);
     fftw_destroy_plan(impl_->plan);
 }
+
+class BatchDctCalculator::Impl {
+public:
+    double *input, *output;
+    size_t width, batch;
+};
+
+BatchDctCalculator::BatchDctCalculator(size_t width, size_t batch) {
+    if (width == 0 || batch == 0) {
+        throw std::invalid_argument("empty batch");
+    }
+    impl_ = std::make_unique<Impl>();
+    impl_->width = width;
+    impl_->batch = batch;
+    impl_->input = fftw_alloc_real(width * width * batch);
+    impl_->output = fftw_alloc_real(width * width * batch);
+}
+
+double *BatchDctCalculator::Input(size_t block) {
+    return impl_->input + block * impl_->width * impl_->width;
+}
+
+const double *BatchDctCalculator::Output(size_t block) const {
+    return impl_->output + block * impl_->width * impl_->width;
+}
+
+void BatchDctCalculator::Inverse(size_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (count > impl_->batch) {
+        throw std::invalid_argument("count is bigger than the batch");
+    }
+    for (size_t i = 0; i < count; i++) {
+        Rescale(Input(i), impl_->width);
+    }
+    fftw_execute_r2r(GetBatchPlan(impl_->width, count), impl_->input, impl_->output);
+}
+
+size_t BatchDctCalculator::Batch() const {
+    return impl_->batch;
+}
+
+BatchDctCalculator::~BatchDctCalculator() {
+    fftw_free(impl_->input);
+    fftw_free(impl_->output);
+}
+
+bool LoadFftwWisdom(const std::string &path) {
+    std::lock_guard lock(planner_mutex);
+    return fftw_import_wisdom_from_filename(path.c_str()) != 0;
+}
+
+bool SaveFftwWisdom(const std::string &path) {
+    std::lock_guard lock(planner_mutex);
+    return fftw_export_wisdom_to_filename(path.c_str()) != 0;
+}
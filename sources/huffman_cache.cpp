@@ -0,0 +1,111 @@
+#include "huffman_cache.h"
+
+#include <algorithm>
+
+#include "constants.h"
+
+namespace {
+
+constexpr HuffmanTree MakeTree(std::span<const Byte> code_lengths, std::span<const Byte> values) {
+    HuffmanTree tree;
+    tree.Build(code_lengths, values);
+    return tree;
+}
+
+struct StdTable {
+    std::span<const Byte> code_lengths, values;
+};
+
+constexpr StdTable kStdTables[] = {
+    {kStdLuminanceDcCounts, kStdLuminanceDcValues},
+    {kStdLuminanceAcCounts, kStdLuminanceAcValues},
+    {kStdChrominanceDcCounts, kStdChrominanceDcValues},
+    {kStdChrominanceAcCounts, kStdChrominanceAcValues},
+};
+
+constexpr HuffmanTree kStdTrees[] = {
+    MakeTree(kStdTables[0].code_lengths, kStdTables[0].values),
+    MakeTree(kStdTables[1].code_lengths, kStdTables[1].values),
+    MakeTree(kStdTables[2].code_lengths, kStdTables[2].values),
+    MakeTree(kStdTables[3].code_lengths, kStdTables[3].values),
+};
+
+// FNV-1a
+uint64_t Hash(std::span<const uint8_t> code_lengths, std::span<const uint8_t> values) {
+    uint64_t res = 0xcbf29ce484222325;
+    auto add = [&res](uint8_t byte) { res = (res ^ byte) * 0x100000001b3; };
+    std::ranges::for_each(code_lengths, add);
+    std::ranges::for_each(values, add);
+    return res;
+}
+
+}  // namespace
+
+HuffmanCache::HuffmanCache(size_t capacity) : capacity_(capacity) {
+}
+
+std::shared_ptr<const HuffmanTree> HuffmanCache::Get(std::span<const uint8_t> code_lengths,
+                                                     std::span<const uint8_t> values) {
+    for (size_t i = 0; i < std::size(kStdTables); i++) {
+        if (std::ranges::equal(code_lengths, kStdTables[i].code_lengths) &&
+            std::ranges::equal(values, kStdTables[i].values)) {
+            // not owned by anyone, they are never destroyed
+            return std::shared_ptr<const HuffmanTree>(std::shared_ptr<void>(), &kStdTrees[i]);
+        }
+    }
+
+    uint64_t hash = Hash(code_lengths, values);
+    {
+        std::lock_guard lock(mutex_);
+        if (auto tree = Find(hash, code_lengths, values)) {
+            return tree;
+        }
+    }
+    // built without the lock, so the other threads don't wait for it
+    auto tree = std::make_shared<HuffmanTree>();
+    tree->Build(code_lengths, values);
+
+    std::lock_guard lock(mutex_);
+    if (auto other = Find(hash, code_lengths, values)) {
+        return other;
+    }
+    if (capacity_ == 0) {
+        return tree;
+    }
+    if (entries_.size() == capacity_) {
+        auto [first, last] = index_.equal_range(entries_.back().hash);
+        index_.erase(std::find_if(first, last, [this](const auto& item) {
+            return item.second == std::prev(entries_.end());
+        }));
+        entries_.pop_back();
+    }
+    entries_.push_front({hash, {code_lengths.begin(), code_lengths.end()},
+                         {values.begin(), values.end()}, tree});
+    index_.emplace(hash, entries_.begin());
+    return tree;
+}
+
+std::shared_ptr<const HuffmanTree> HuffmanCache::Find(uint64_t hash,
+                                                      std::span<const uint8_t> code_lengths,
+                                                      std::span<const uint8_t> values) {
+    auto [first, last] = index_.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        Entry& entry = *it->second;
+        if (std::ranges::equal(entry.code_lengths, code_lengths) &&
+            std::ranges::equal(entry.values, values)) {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return entry.tree;
+        }
+    }
+    return nullptr;
+}
+
+size_t HuffmanCache::Size() const {
+    std::lock_guard lock(mutex_);
+    return entries_.size();
+}
+
+HuffmanCache& HuffmanCache::Global() {
+    static HuffmanCache cache;
+    return cache;
+}
@@ -0,0 +1,670 @@
+#include <idct.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "constants.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define JPEG_DECODER_X86
+#endif
+
+#ifdef JPEG_DECODER_WITH_FFTW
+#include <fft.h>
+#endif
+
+namespace {
+// Same constants and scaling as jidctint.c of the IJG library.
+constexpr int kConstBits = 13;
+constexpr int kPass1Bits = 2;
+constexpr int kPass1Shift = kConstBits - kPass1Bits;
+constexpr int kPass2Shift = kConstBits + kPass1Bits + 3;
+constexpr int32_t kPass1Bias = 1 << (kPass1Shift - 1);
+// the level shift is folded into the rounding of the second pass
+constexpr int32_t kPass2Bias = (1 << (kPass2Shift - 1)) + (128 << kPass2Shift);
+
+static_assert([] {
+    for (int i = 0; i < kBlockSize; i++) {
+        for (int j = 0; j < kBlockSize; j++) {
+            bool low = i < kLowBlockSize && j < kLowBlockSize;
+            if (kZigZagIndexesMatching[i][j] < kLowCoefs && !low) {
+                return false;
+            }
+        }
+    }
+    return true;
+}(), "the first kLowCoefs coefficients in zigzag order must be in the low corner");
+
+constexpr int32_t Fix(double x) {
+    return static_cast<int32_t>(x * (1 << kConstBits) + 0.5);
+}
+
+constexpr int32_t kFix0298 = Fix(0.298631336);
+constexpr int32_t kFix0390 = Fix(0.390180644);
+constexpr int32_t kFix0541 = Fix(0.541196100);
+constexpr int32_t kFix0765 = Fix(0.765366865);
+constexpr int32_t kFix0899 = Fix(0.899976223);
+constexpr int32_t kFix1175 = Fix(1.175875602);
+constexpr int32_t kFix1501 = Fix(1.501321110);
+constexpr int32_t kFix1847 = Fix(1.847759065);
+constexpr int32_t kFix1961 = Fix(1.961570560);
+constexpr int32_t kFix2053 = Fix(2.053119869);
+constexpr int32_t kFix2562 = Fix(2.562915447);
+constexpr int32_t kFix3072 = Fix(3.072711026);
+// reduced transforms
+constexpr int32_t kFix0211 = Fix(0.211164243);
+constexpr int32_t kFix0509 = Fix(0.509795579);
+constexpr int32_t kFix0601 = Fix(0.601344887);
+constexpr int32_t kFix0720 = Fix(0.720959822);
+constexpr int32_t kFix0850 = Fix(0.850430095);
+constexpr int32_t kFix1061 = Fix(1.061594337);
+constexpr int32_t kFix1272 = Fix(1.272758580);
+constexpr int32_t kFix1451 = Fix(1.451774981);
+constexpr int32_t kFix2172 = Fix(2.172734803);
+constexpr int32_t kFix3624 = Fix(3.624509785);
+
+// Results of the first pass are kept in 16 bits, as the SIMD versions do.
+int32_t Clamp16(int32_t x) {
+    return std::clamp<int32_t>(x, INT16_MIN, INT16_MAX);
+}
+
+// 1-D transform of in[0], in[step], ..., in[7 * step], outputs are scaled by 2^kConstBits.
+// With kLow inputs 4..7 are known to be zero and the terms with them fold away, the
+// result is the same.
+template <bool kLow = false, class T>
+void Idct8(const T* in, size_t step, int32_t* out) {
+    auto at = [in, step](int i) -> int32_t {
+        return kLow && i >= kLowBlockSize ? 0 : in[i * step];
+    };
+    // even part
+    int32_t z2 = at(2), z3 = at(6);
+    int32_t z1 = (z2 + z3) * kFix0541;
+    int32_t tmp2 = z1 - z3 * kFix1847;
+    int32_t tmp3 = z1 + z2 * kFix0765;
+    int32_t tmp0 = (at(0) + at(4)) * (1 << kConstBits);
+    int32_t tmp1 = (at(0) - at(4)) * (1 << kConstBits);
+
+    int32_t tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+    // odd part
+    tmp0 = at(7), tmp1 = at(5), tmp2 = at(3), tmp3 = at(1);
+    z1 = tmp0 + tmp3, z2 = tmp1 + tmp2, z3 = tmp0 + tmp2;
+    int32_t z4 = tmp1 + tmp3;
+    int32_t z5 = (z3 + z4) * kFix1175;
+
+    tmp0 *= kFix0298, tmp1 *= kFix2053, tmp2 *= kFix3072, tmp3 *= kFix1501;
+    z1 *= -kFix0899, z2 *= -kFix2562, z3 *= -kFix1961, z4 *= -kFix0390;
+    z3 += z5, z4 += z5;
+    tmp0 += z1 + z3, tmp1 += z2 + z4, tmp2 += z2 + z3, tmp3 += z1 + z4;
+
+    out[0] = tmp10 + tmp3, out[7] = tmp10 - tmp3;
+    out[1] = tmp11 + tmp2, out[6] = tmp11 - tmp2;
+    out[2] = tmp12 + tmp1, out[5] = tmp12 - tmp1;
+    out[3] = tmp13 + tmp0, out[4] = tmp13 - tmp0;
+}
+
+// 4-point transform from the 8 inputs, outputs are scaled by 2^(kConstBits + 1).
+// Input 4 isn't used. Constants and scaling are the ones of jidctred.c of libjpeg 6b.
+template <class T>
+void Idct4(const T* in, size_t step, int32_t* out) {
+    int32_t tmp0 = in[0] * (1 << (kConstBits + 1));
+    int32_t tmp2 = in[2 * step] * kFix1847 - in[6 * step] * kFix0765;
+    int32_t tmp10 = tmp0 + tmp2, tmp12 = tmp0 - tmp2;
+
+    int32_t z1 = in[7 * step], z2 = in[5 * step], z3 = in[3 * step], z4 = in[step];
+    tmp0 = -z1 * kFix0211 + z2 * kFix1451 - z3 * kFix2172 + z4 * kFix1061;
+    tmp2 = -z1 * kFix0509 - z2 * kFix0601 + z3 * kFix0899 + z4 * kFix2562;
+
+    out[0] = tmp10 + tmp2, out[3] = tmp10 - tmp2;
+    out[1] = tmp12 + tmp0, out[2] = tmp12 - tmp0;
+}
+
+// 2-point transform, outputs are scaled by 2^(kConstBits + 2). Only the odd inputs and
+// the DC are used.
+template <class T>
+void Idct2(const T* in, size_t step, int32_t* out) {
+    int32_t tmp10 = in[0] * (1 << (kConstBits + 2));
+    int32_t tmp0 = -in[7 * step] * kFix0720 + in[5 * step] * kFix0850 -
+                   in[3 * step] * kFix1272 + in[step] * kFix3624;
+    out[0] = tmp10 + tmp0, out[1] = tmp10 - tmp0;
+}
+
+int32_t Descale(int32_t x, int shift) {
+    return (x + (1 << (shift - 1))) >> shift;
+}
+
+Byte RangeLimit(int32_t x) {
+    return std::clamp(x + 128, 0, 255);
+}
+
+// Reduced transform producing a |kSize|x|kSize| block. Columns that Pass 2 doesn't read
+// are skipped.
+template <int kSize>
+void InverseReduced(const int16_t* coefs, Byte* out, size_t stride) {
+    constexpr int kExtraBits = kSize == 4 ? 1 : 2;
+    int32_t workspace[kSize * kBlockSize];
+    int32_t tmp[kSize];
+
+    // columns
+    for (int col = 0; col < kBlockSize; col++) {
+        if ((kSize == 4 && col == 4) || (kSize == 2 && col % 2 == 0 && col != 0)) {
+            continue;
+        }
+        const int16_t* in = coefs + col;
+        bool ac_zero = true;
+        for (int row = 1; row < kBlockSize && ac_zero; row++) {
+            ac_zero = in[row * kBlockSize] == 0;
+        }
+        if (ac_zero) {
+            for (int row = 0; row < kSize; row++) {
+                workspace[row * kBlockSize + col] = in[0] * (1 << kPass1Bits);
+            }
+            continue;
+        }
+        if constexpr (kSize == 4) {
+            Idct4(in, kBlockSize, tmp);
+        } else {
+            Idct2(in, kBlockSize, tmp);
+        }
+        for (int row = 0; row < kSize; row++) {
+            workspace[row * kBlockSize + col] = Descale(tmp[row], kPass1Shift + kExtraBits);
+        }
+    }
+
+    // rows
+    for (int row = 0; row < kSize; row++, out += stride) {
+        if constexpr (kSize == 4) {
+            Idct4(workspace + row * kBlockSize, 1, tmp);
+        } else {
+            Idct2(workspace + row * kBlockSize, 1, tmp);
+        }
+        for (int col = 0; col < kSize; col++) {
+            out[col] = RangeLimit(Descale(tmp[col], kConstBits + kPass1Bits + 3 + kExtraBits));
+        }
+    }
+}
+
+// The transform of InverseScalar, with kLow only for the blocks InverseScalarLow takes.
+template <bool kLow>
+void InverseLlm(const int16_t* coefs, Byte* out, size_t stride) {
+    constexpr int kInputs = kLow ? kLowBlockSize : kBlockSize;
+    int32_t workspace[kFullBlock];
+    int32_t tmp[kBlockSize];
+
+    // columns, the ones past kInputs are zero
+    for (int col = 0; col < kBlockSize; col++) {
+        if (col >= kInputs) {
+            for (int row = 0; row < kBlockSize; row++) {
+                workspace[row * kBlockSize + col] = 0;
+            }
+            continue;
+        }
+        const int16_t* in = coefs + col;
+        bool ac_zero = true;
+        for (int row = 1; row < kInputs && ac_zero; row++) {
+            ac_zero = in[row * kBlockSize] == 0;
+        }
+        if (ac_zero) {
+            int32_t dc = Clamp16(in[0] * (1 << kPass1Bits));
+            for (int row = 0; row < kBlockSize; row++) {
+                workspace[row * kBlockSize + col] = dc;
+            }
+            continue;
+        }
+        Idct8<kLow>(in, kBlockSize, tmp);
+        for (int row = 0; row < kBlockSize; row++) {
+            workspace[row * kBlockSize + col] = Clamp16((tmp[row] + kPass1Bias) >> kPass1Shift);
+        }
+    }
+
+    // rows
+    for (int row = 0; row < kBlockSize; row++, out += stride) {
+        Idct8<kLow>(workspace + row * kBlockSize, 1, tmp);
+        for (int col = 0; col < kBlockSize; col++) {
+            out[col] = std::clamp((tmp[col] + kPass2Bias) >> kPass2Shift, 0, 255);
+        }
+    }
+}
+
+#ifdef JPEG_DECODER_X86
+// The odd part of Idct8 written as a 4x4 matrix over (in7, in5, in3, in1), so that
+// every product is a 16-bit coefficient times a 16-bit constant (pmaddwd).
+// Integer arithmetic is exact, so this matches Idct8.
+constexpr int16_t kOdd[4][4] = {
+    {kFix0298 - kFix0899 - kFix1961 + kFix1175, kFix1175, kFix1175 - kFix1961,
+     kFix1175 - kFix0899},
+    {kFix1175, kFix2053 - kFix2562 - kFix0390 + kFix1175, kFix1175 - kFix2562,
+     kFix1175 - kFix0390},
+    {kFix1175 - kFix1961, kFix1175 - kFix2562, kFix3072 - kFix2562 - kFix1961 + kFix1175,
+     kFix1175},
+    {kFix1175 - kFix0899, kFix1175 - kFix0390, kFix1175, kFix1501 - kFix0899 - kFix0390 + kFix1175},
+};
+
+struct Sse2Pair {
+    __m128i lo, hi;
+};
+
+Sse2Pair operator+(Sse2Pair a, Sse2Pair b) {
+    return {_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)};
+}
+
+Sse2Pair operator-(Sse2Pair a, Sse2Pair b) {
+    return {_mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi)};
+}
+
+// a * ca + b * cb for 8 lanes of 16-bit values, given interleaved (a, b).
+Sse2Pair MulAddSse2(Sse2Pair ab, int16_t ca, int16_t cb) {
+    __m128i k = _mm_set_epi16(cb, ca, cb, ca, cb, ca, cb, ca);
+    return {_mm_madd_epi16(ab.lo, k), _mm_madd_epi16(ab.hi, k)};
+}
+
+Sse2Pair InterleaveSse2(__m128i a, __m128i b) {
+    return {_mm_unpacklo_epi16(a, b), _mm_unpackhi_epi16(a, b)};
+}
+
+__m128i DescaleSse2(Sse2Pair x, int32_t bias, int shift) {
+    __m128i b = _mm_set1_epi32(bias);
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(x.lo, b), shift),
+                           _mm_srai_epi32(_mm_add_epi32(x.hi, b), shift));
+}
+
+// One pass over 8 independent lanes: data[i] holds the i-th input of every lane. With kLow
+// inputs 4..7 are zero and the products with them are skipped.
+template <bool kLow = false>
+void PassSse2(__m128i* data, int32_t bias, int shift) {
+    Sse2Pair tmp0, tmp1, tmp2, tmp3;
+    if constexpr (kLow) {
+        // in0 * 2^kConstBits: in0 in the high halves of 32-bit lanes, shifted back
+        __m128i zero = _mm_setzero_si128();
+        tmp0 = {_mm_srai_epi32(_mm_unpacklo_epi16(zero, data[0]), 16 - kConstBits),
+                _mm_srai_epi32(_mm_unpackhi_epi16(zero, data[0]), 16 - kConstBits)};
+        tmp1 = tmp0;
+        Sse2Pair in2 = InterleaveSse2(data[2], zero);
+        tmp2 = MulAddSse2(in2, kFix0541, 0);
+        tmp3 = MulAddSse2(in2, kFix0541 + kFix0765, 0);
+    } else {
+        Sse2Pair in04 = InterleaveSse2(data[0], data[4]);
+        Sse2Pair in26 = InterleaveSse2(data[2], data[6]);
+        tmp0 = MulAddSse2(in04, 1 << kConstBits, 1 << kConstBits);
+        tmp1 = MulAddSse2(in04, 1 << kConstBits, -(1 << kConstBits));
+        tmp2 = MulAddSse2(in26, kFix0541, kFix0541 - kFix1847);
+        tmp3 = MulAddSse2(in26, kFix0541 + kFix0765, kFix0541);
+    }
+
+    Sse2Pair tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    Sse2Pair tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+    Sse2Pair in31 = InterleaveSse2(data[3], data[1]);
+    Sse2Pair odd[4];
+    for (int i = 0; i < 4; i++) {
+        odd[i] = MulAddSse2(in31, kOdd[i][2], kOdd[i][3]);
+        if constexpr (!kLow) {
+            odd[i] = odd[i] + MulAddSse2(InterleaveSse2(data[7], data[5]), kOdd[i][0],
+                                         kOdd[i][1]);
+        }
+    }
+
+    data[0] = DescaleSse2(tmp10 + odd[3], bias, shift);
+    data[7] = DescaleSse2(tmp10 - odd[3], bias, shift);
+    data[1] = DescaleSse2(tmp11 + odd[2], bias, shift);
+    data[6] = DescaleSse2(tmp11 - odd[2], bias, shift);
+    data[2] = DescaleSse2(tmp12 + odd[1], bias, shift);
+    data[5] = DescaleSse2(tmp12 - odd[1], bias, shift);
+    data[3] = DescaleSse2(tmp13 + odd[0], bias, shift);
+    data[4] = DescaleSse2(tmp13 - odd[0], bias, shift);
+}
+
+void TransposeSse2(__m128i* r) {
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+    r[0] = _mm_unpacklo_epi64(b0, b4), r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5), r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6), r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7), r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+#define JPEG_DECODER_AVX2 __attribute__((target("avx2")))
+
+JPEG_DECODER_AVX2 __m256i DescaleAvx2(__m256i x, int32_t bias, int shift) {
+    return _mm256_srai_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(bias)), shift);
+}
+
+JPEG_DECODER_AVX2 __m256i MulAvx2(__m256i x, int32_t c) {
+    return _mm256_mullo_epi32(x, _mm256_set1_epi32(c));
+}
+
+// Idct8 over 8 independent 32-bit lanes, outputs are descaled. With kLow inputs 4..7 are
+// zero, and the compiler folds the terms with them away.
+template <bool kLow = false>
+JPEG_DECODER_AVX2 void PassAvx2(__m256i* data, int32_t bias, int shift) {
+    __m256i at[kBlockSize];
+    for (int i = 0; i < kBlockSize; i++) {
+        at[i] = kLow && i >= kLowBlockSize ? _mm256_setzero_si256() : data[i];
+    }
+    __m256i z2 = at[2], z3 = at[6];
+    __m256i z1 = MulAvx2(_mm256_add_epi32(z2, z3), kFix0541);
+    __m256i tmp2 = _mm256_sub_epi32(z1, MulAvx2(z3, kFix1847));
+    __m256i tmp3 = _mm256_add_epi32(z1, MulAvx2(z2, kFix0765));
+    __m256i tmp0 = _mm256_slli_epi32(_mm256_add_epi32(at[0], at[4]), kConstBits);
+    __m256i tmp1 = _mm256_slli_epi32(_mm256_sub_epi32(at[0], at[4]), kConstBits);
+
+    __m256i tmp10 = _mm256_add_epi32(tmp0, tmp3), tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+    __m256i tmp11 = _mm256_add_epi32(tmp1, tmp2), tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+    tmp0 = at[7], tmp1 = at[5], tmp2 = at[3], tmp3 = at[1];
+    z1 = _mm256_add_epi32(tmp0, tmp3), z2 = _mm256_add_epi32(tmp1, tmp2);
+    z3 = _mm256_add_epi32(tmp0, tmp2);
+    __m256i z4 = _mm256_add_epi32(tmp1, tmp3);
+    __m256i z5 = MulAvx2(_mm256_add_epi32(z3, z4), kFix1175);
+
+    tmp0 = MulAvx2(tmp0, kFix0298), tmp1 = MulAvx2(tmp1, kFix2053);
+    tmp2 = MulAvx2(tmp2, kFix3072), tmp3 = MulAvx2(tmp3, kFix1501);
+    z1 = MulAvx2(z1, -kFix0899), z2 = MulAvx2(z2, -kFix2562);
+    z3 = _mm256_add_epi32(MulAvx2(z3, -kFix1961), z5);
+    z4 = _mm256_add_epi32(MulAvx2(z4, -kFix0390), z5);
+    tmp0 = _mm256_add_epi32(tmp0, _mm256_add_epi32(z1, z3));
+    tmp1 = _mm256_add_epi32(tmp1, _mm256_add_epi32(z2, z4));
+    tmp2 = _mm256_add_epi32(tmp2, _mm256_add_epi32(z2, z3));
+    tmp3 = _mm256_add_epi32(tmp3, _mm256_add_epi32(z1, z4));
+
+    data[0] = DescaleAvx2(_mm256_add_epi32(tmp10, tmp3), bias, shift);
+    data[7] = DescaleAvx2(_mm256_sub_epi32(tmp10, tmp3), bias, shift);
+    data[1] = DescaleAvx2(_mm256_add_epi32(tmp11, tmp2), bias, shift);
+    data[6] = DescaleAvx2(_mm256_sub_epi32(tmp11, tmp2), bias, shift);
+    data[2] = DescaleAvx2(_mm256_add_epi32(tmp12, tmp1), bias, shift);
+    data[5] = DescaleAvx2(_mm256_sub_epi32(tmp12, tmp1), bias, shift);
+    data[3] = DescaleAvx2(_mm256_add_epi32(tmp13, tmp0), bias, shift);
+    data[4] = DescaleAvx2(_mm256_sub_epi32(tmp13, tmp0), bias, shift);
+}
+
+JPEG_DECODER_AVX2 void TransposeAvx2(__m256i* r) {
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+template <bool kLow>
+void InverseSse2Impl(const int16_t* coefs, Byte* out, size_t stride) {
+    __m128i data[kBlockSize];
+    for (int i = 0; i < kBlockSize; i++) {
+        data[i] = kLow && i >= kLowBlockSize ? _mm_setzero_si128()
+                                             : _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                                                   coefs + i * kBlockSize));
+    }
+    // the columns past kLowBlockSize are zero after the first pass, so after the transpose
+    // the second one gets zero inputs 4..7 too
+    PassSse2<kLow>(data, kPass1Bias, kPass1Shift);
+    TransposeSse2(data);
+    PassSse2<kLow>(data, kPass2Bias, kPass2Shift);
+    TransposeSse2(data);
+    for (int i = 0; i < kBlockSize; i += 2) {
+        __m128i rows = _mm_packus_epi16(data[i], data[i + 1]);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i * stride), rows);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + (i + 1) * stride),
+                         _mm_srli_si128(rows, 8));
+    }
+}
+
+template <bool kLow>
+JPEG_DECODER_AVX2 void InverseAvx2Impl(const int16_t* coefs, Byte* out, size_t stride) {
+    __m256i data[kBlockSize];
+    for (int i = 0; i < kBlockSize; i++) {
+        data[i] = kLow && i >= kLowBlockSize
+                      ? _mm256_setzero_si256()
+                      : _mm256_cvtepi16_epi32(_mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(coefs + i * kBlockSize)));
+    }
+    PassAvx2<kLow>(data, kPass1Bias, kPass1Shift);
+    __m256i min16 = _mm256_set1_epi32(INT16_MIN), max16 = _mm256_set1_epi32(INT16_MAX);
+    for (auto& row : data) {
+        row = _mm256_min_epi32(_mm256_max_epi32(row, min16), max16);
+    }
+    TransposeAvx2(data);
+    PassAvx2<kLow>(data, kPass2Bias, kPass2Shift);
+    TransposeAvx2(data);
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (int i = 0; i < kBlockSize; i += 4) {
+        __m256i rows = _mm256_packus_epi16(_mm256_packs_epi32(data[i], data[i + 1]),
+                                           _mm256_packs_epi32(data[i + 2], data[i + 3]));
+        rows = _mm256_permutevar8x32_epi32(rows, order);
+        __m128i halves[2] = {_mm256_castsi256_si128(rows), _mm256_extracti128_si256(rows, 1)};
+        for (int j = 0; j < 4; j += 2) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + (i + j) * stride), halves[j / 2]);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + (i + j + 1) * stride),
+                             _mm_srli_si128(halves[j / 2], 8));
+        }
+    }
+}
+#endif
+}  // namespace
+
+namespace idct {
+void InverseScalar(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseLlm<false>(coefs, out, stride);
+}
+
+void InverseScalarLow(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseLlm<true>(coefs, out, stride);
+}
+
+void InverseScalar4x4(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseReduced<4>(coefs, out, stride);
+}
+
+void InverseScalar2x2(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseReduced<2>(coefs, out, stride);
+}
+
+void InverseDc(const int16_t* coefs, Byte* out, size_t) {
+    out[0] = RangeLimit(Descale(coefs[0], 3));
+}
+
+void FillDc(const int16_t* coefs, Byte* out, size_t stride) {
+    // a lone DC goes through the first pass as in the shortcut of InverseScalar, and
+    // through the second one as the even part of the row
+    int32_t dc = Clamp16(coefs[0] * (1 << kPass1Bits));
+    int value = std::clamp((dc * (1 << kConstBits) + kPass2Bias) >> kPass2Shift, 0, 255);
+    for (int row = 0; row < kBlockSize; row++) {
+        std::memset(out + row * stride, value, kBlockSize);
+    }
+}
+
+#ifdef JPEG_DECODER_X86
+void InverseSse2(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseSse2Impl<false>(coefs, out, stride);
+}
+
+void InverseSse2Low(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseSse2Impl<true>(coefs, out, stride);
+}
+
+JPEG_DECODER_AVX2 void InverseAvx2(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseAvx2Impl<false>(coefs, out, stride);
+}
+
+JPEG_DECODER_AVX2 void InverseAvx2Low(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseAvx2Impl<true>(coefs, out, stride);
+}
+#else
+void InverseSse2(const int16_t*, Byte*, size_t) {
+    throw std::runtime_error("SSE2 IDCT is not supported on this platform");
+}
+
+void InverseSse2Low(const int16_t*, Byte*, size_t) {
+    throw std::runtime_error("SSE2 IDCT is not supported on this platform");
+}
+
+void InverseAvx2(const int16_t*, Byte*, size_t) {
+    throw std::runtime_error("AVX2 IDCT is not supported on this platform");
+}
+
+void InverseAvx2Low(const int16_t*, Byte*, size_t) {
+    throw std::runtime_error("AVX2 IDCT is not supported on this platform");
+}
+#endif
+}  // namespace idct
+
+#ifdef JPEG_DECODER_WITH_FFTW
+class Idct::FftwImpl {
+public:
+    explicit FftwImpl(size_t batch) : calculator_(kBlockSize, batch) {
+    }
+
+    void InverseMany(const int16_t* coefs, size_t count, Byte* const* outs, size_t stride) {
+        for (size_t done = 0; done < count;) {
+            size_t cur = std::min(count - done, calculator_.Batch());
+            for (size_t i = 0; i < cur; i++) {
+                std::copy(coefs + (done + i) * kFullBlock, coefs + (done + i + 1) * kFullBlock,
+                          calculator_.Input(i));
+            }
+            calculator_.Inverse(cur);
+            for (size_t i = 0; i < cur; i++) {
+                const double* output = calculator_.Output(i);
+                Byte* out = outs[done + i];
+                for (int y = 0; y < kBlockSize; y++) {
+                    for (int x = 0; x < kBlockSize; x++) {
+                        out[y * stride + x] =
+                            std::min(255., std::max(0., 128 + round(output[y * kBlockSize + x])));
+                    }
+                }
+            }
+            done += cur;
+        }
+    }
+
+private:
+    BatchDctCalculator calculator_;
+};
+#else
+class Idct::FftwImpl {};
+#endif
+
+Idct::Idct(IdctBackend backend, [[maybe_unused]] size_t batch) : backend_(backend) {
+    if (backend_ == IdctBackend::kAuto) {
+        backend_ = IsAvailable(IdctBackend::kAvx2)   ? IdctBackend::kAvx2
+                   : IsAvailable(IdctBackend::kSse2) ? IdctBackend::kSse2
+                                                     : IdctBackend::kScalar;
+    }
+    if (!IsAvailable(backend_)) {
+        throw std::invalid_argument("requested IDCT backend is not available");
+    }
+    switch (backend_) {
+        case IdctBackend::kScalar:
+            inverse_ = idct::InverseScalar;
+            inverse_low_ = idct::InverseScalarLow;
+            break;
+        case IdctBackend::kSse2:
+            inverse_ = idct::InverseSse2;
+            inverse_low_ = idct::InverseSse2Low;
+            break;
+        case IdctBackend::kAvx2:
+            inverse_ = idct::InverseAvx2;
+            inverse_low_ = idct::InverseAvx2Low;
+            break;
+        default:
+#ifdef JPEG_DECODER_WITH_FFTW
+            fftw_ = std::make_unique<FftwImpl>(std::max<size_t>(batch, 1));
+#endif
+            break;
+    }
+}
+
+void Idct::Inverse(const int16_t* coefs, Byte* out, size_t stride) {
+    InverseMany(coefs, 1, &out, stride);
+}
+
+void Idct::InverseMany(const int16_t* coefs, size_t count, Byte* const* outs, size_t stride) {
+#ifdef JPEG_DECODER_WITH_FFTW
+    if (fftw_) {
+        fftw_->InverseMany(coefs, count, outs, stride);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        inverse_(coefs + i * kFullBlock, outs[i], stride);
+    }
+}
+
+void Idct::InverseMany(const int16_t* coefs, const Byte* last, size_t count, Byte* const* outs,
+                       size_t stride) {
+    if (!inverse_low_) {
+        InverseMany(coefs, count, outs, stride);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (last[i] == 0) {
+            idct::FillDc(coefs + i * kFullBlock, outs[i], stride);
+        } else if (last[i] < kLowCoefs) {
+            inverse_low_(coefs + i * kFullBlock, outs[i], stride);
+        } else {
+            inverse_(coefs + i * kFullBlock, outs[i], stride);
+        }
+    }
+}
+
+bool Idct::IsAvailable(IdctBackend backend) {
+    switch (backend) {
+        case IdctBackend::kAuto:
+        case IdctBackend::kScalar:
+            return true;
+        case IdctBackend::kFftw:
+#ifdef JPEG_DECODER_WITH_FFTW
+            return true;
+#else
+            return false;
+#endif
+#ifdef JPEG_DECODER_X86
+        case IdctBackend::kSse2:
+            return __builtin_cpu_supports("sse2");
+        case IdctBackend::kAvx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+bool Idct::LoadFftwWisdom([[maybe_unused]] const std::string& path) {
+#ifdef JPEG_DECODER_WITH_FFTW
+    return ::LoadFftwWisdom(path);
+#else
+    return false;
+#endif
+}
+
+bool Idct::SaveFftwWisdom([[maybe_unused]] const std::string& path) {
+#ifdef JPEG_DECODER_WITH_FFTW
+    return ::SaveFftwWisdom(path);
+#else
+    return false;
+#endif
+}
+
+Idct::Idct(Idct&&) = default;
+
+Idct& Idct::operator=(Idct&&) = default;
+
+Idct::~Idct() = default;
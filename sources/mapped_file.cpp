@@ -0,0 +1,72 @@
+#include <mapped_file.h>
+
+#include <cerrno>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JPEG_DECODER_MMAP
+#else
+#include <fstream>
+#endif
+
+namespace {
+[[noreturn]] void ThrowSystemError(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+}  // namespace
+
+#ifdef JPEG_DECODER_MMAP
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ThrowSystemError("can't open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        ThrowSystemError("can't stat " + path);
+    }
+    size_ = info.st_size;
+    if (size_ > 0) {
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            ThrowSystemError("can't map " + path);
+        }
+        // the decoder reads the file front to back
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const std::byte*>(data);
+        mapped_ = true;
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (mapped_) {
+        munmap(const_cast<std::byte*>(data_), size_);
+    }
+}
+#else
+MappedFile::MappedFile(const std::string& path) {
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    if (!input) {
+        ThrowSystemError("can't open " + path);
+    }
+    fallback_.resize(input.tellg());
+    input.seekg(0);
+    input.read(reinterpret_cast<char*>(fallback_.data()), fallback_.size());
+    data_ = fallback_.data();
+    size_ = fallback_.size();
+}
+
+MappedFile::~MappedFile() {
+}
+#endif
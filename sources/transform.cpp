@@ -0,0 +1,166 @@
+#include "transform.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <utility>
+
+#include "constants.h"
+
+namespace {
+
+// Every transform is an optional transpose followed by optional flips.
+struct Geometry {
+    bool transpose, flip_x, flip_y;
+};
+
+Geometry GeometryOf(TransformOp op) {
+    switch (op) {
+        case TransformOp::kNone:
+            return {false, false, false};
+        case TransformOp::kFlipHorizontal:
+            return {false, true, false};
+        case TransformOp::kFlipVertical:
+            return {false, false, true};
+        case TransformOp::kRotate180:
+            return {false, true, true};
+        case TransformOp::kTranspose:
+            return {true, false, false};
+        case TransformOp::kRotate90:
+            return {true, true, false};
+        case TransformOp::kRotate270:
+            return {true, false, true};
+        case TransformOp::kTransverse:
+            return {true, true, true};
+    }
+    throw std::invalid_argument("unknown transform");
+}
+
+// Coefficient n of a transformed block is sign[n] * source block[from[n]]: transposing
+// the pixels transposes the coefficients, and a flip negates the odd frequencies along it.
+struct BlockMap {
+    std::array<int, kFullBlock> from;
+    std::array<int, kFullBlock> sign;
+};
+
+BlockMap MakeBlockMap(const Geometry& geometry) {
+    BlockMap res;
+    for (int v = 0; v < kBlockSize; v++) {
+        for (int u = 0; u < kBlockSize; u++) {
+            int n = v * kBlockSize + u;
+            res.from[n] = geometry.transpose ? u * kBlockSize + v : n;
+            bool negate = (geometry.flip_x && u % 2 == 1) != (geometry.flip_y && v % 2 == 1);
+            res.sign[n] = negate ? -1 : 1;
+        }
+    }
+    return res;
+}
+
+}  // namespace
+
+CoefficientImage Transform(const CoefficientImage& image, TransformOp op,
+                           const std::optional<Rect>& crop) {
+    Geometry geometry = GeometryOf(op);
+    bool single = image.components.size() == 1;
+    CoefficientImage res;
+    res.comment = image.comment;
+    res.quantization_tables = image.quantization_tables;
+    res.huffman_tables = image.huffman_tables;
+    if (geometry.transpose) {
+        for (QuantizationTableValues& table : res.quantization_tables) {
+            auto values = table.values;
+            for (int v = 0; v < kBlockSize; v++) {
+                for (int u = 0; u < kBlockSize; u++) {
+                    table.values[v * kBlockSize + u] = values[u * kBlockSize + v];
+                }
+            }
+        }
+    }
+
+    // sampling factors of the result, a gray image is always one block per MCU
+    std::vector<std::pair<int, int>> sampling;
+    int hor = 1, ver = 1;
+    for (const CoefficientPlane& plane : image.components) {
+        auto [cur_hor, cur_ver] = std::pair{plane.horizontal, plane.vertical};
+        if (geometry.transpose) {
+            std::swap(cur_hor, cur_ver);
+        }
+        if (single) {
+            cur_hor = cur_ver = 1;
+        }
+        sampling.emplace_back(cur_hor, cur_ver);
+        hor = std::max(hor, cur_hor);
+        ver = std::max(ver, cur_ver);
+    }
+
+    size_t width = geometry.transpose ? image.height : image.width;
+    size_t height = geometry.transpose ? image.width : image.height;
+    size_t mcu_width = hor * kBlockSize, mcu_height = ver * kBlockSize;
+    if (geometry.flip_x) {
+        width -= width % mcu_width;
+    }
+    if (geometry.flip_y) {
+        height -= height % mcu_height;
+    }
+    // MCUs of the transformed image before cropping, whole ones along the flips
+    size_t full_mcus_x = (width + mcu_width - 1) / mcu_width;
+    size_t full_mcus_y = (height + mcu_height - 1) / mcu_height;
+    size_t first_mcu_x = 0, first_mcu_y = 0;
+    if (crop) {
+        size_t x = std::min(crop->x, width), y = std::min(crop->y, height);
+        size_t right = x + std::min(crop->width, width - x);
+        size_t bottom = y + std::min(crop->height, height - y);
+        first_mcu_x = x / mcu_width;
+        first_mcu_y = y / mcu_height;
+        width = right - first_mcu_x * mcu_width;
+        height = bottom - first_mcu_y * mcu_height;
+    }
+    if (width == 0 || height == 0) {
+        throw std::invalid_argument("nothing is left of the image after trimming and cropping");
+    }
+    res.width = width;
+    res.height = height;
+    size_t mcus_x = (width + mcu_width - 1) / mcu_width;
+    size_t mcus_y = (height + mcu_height - 1) / mcu_height;
+
+    BlockMap map = MakeBlockMap(geometry);
+    for (size_t i = 0; i < image.components.size(); i++) {
+        const CoefficientPlane& source = image.components[i];
+        auto [cur_hor, cur_ver] = sampling[i];
+        CoefficientPlane plane{source.id, cur_hor, cur_ver, source.quantization_table,
+                               source.dc_table, source.ac_table};
+        plane.blocks_x = mcus_x * cur_hor;
+        plane.blocks_y = mcus_y * cur_ver;
+        plane.coefs.assign(plane.blocks_x * plane.blocks_y * kFullBlock, 0);
+        size_t full_x = full_mcus_x * cur_hor, full_y = full_mcus_y * cur_ver;
+        for (size_t by = 0; by < plane.blocks_y; by++) {
+            for (size_t bx = 0; bx < plane.blocks_x; bx++) {
+                // position in the transformed image before cropping, then in the source
+                size_t x = bx + first_mcu_x * cur_hor, y = by + first_mcu_y * cur_ver;
+                if (geometry.flip_x) {
+                    x = full_x - 1 - x;
+                }
+                if (geometry.flip_y) {
+                    y = full_y - 1 - y;
+                }
+                auto [source_x, source_y] = geometry.transpose ? std::pair{y, x} : std::pair{x, y};
+                // padding blocks past the end of the source stay zero
+                if (source_x >= source.blocks_x || source_y >= source.blocks_y) {
+                    continue;
+                }
+                auto in = source.Block(source_x, source_y);
+                auto out = plane.Block(bx, by);
+                for (int n = 0; n < kFullBlock; n++) {
+                    out[n] = map.sign[n] * in[map.from[n]];
+                }
+            }
+        }
+        res.components.push_back(std::move(plane));
+    }
+    return res;
+}
+
+std::vector<uint8_t> Transform(std::span<const std::byte> jpeg, const TransformOptions& options) {
+    return EncodeCoefficients(Transform(DecodeCoefficients(jpeg), options.op, options.crop),
+                              options.tables);
+}
@@ -1,11 +1,11 @@
 #include "utils.h"
 
-const char* ToString(Marker v) {
+const char* utils::ToString(Marker v) {
     switch (v) {
         case SOI:
             return "SOI";
         case EOI:
-            return "EIO";
+            return "EOI";
         case COM:
             return "COM";
         case APPn:
@@ -14,10 +14,16 @@ const char* ToString(Marker v) {
             return "DQT";
         case SOF0:
             return "SOF0";
+        case SOF2:
+            return "SOF2";
         case DHT:
             return "DHT";
         case SOS:
             return "SOS";
+        case DRI:
+            return "DRI";
+        case RSTn:
+            return "RSTn";
         default:
             return "[Unknown Marker]";
     }